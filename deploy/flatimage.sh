@@ -62,9 +62,6 @@ function _fetch_static()
   # Make binaries executable
   chmod 755 ./bin/*
 
-  # Compress binaries
-  upx -6 --no-lzma bin/* || true
-
   # Create symlinks
   (
     cd bin
@@ -76,35 +73,84 @@ function _fetch_static()
   )
 }
 
+# Writes a 64-bit little-endian unsigned integer
+# $1 = Value
+# $2 = Output file
+function _write_u64()
+{
+  local hex="$(printf "%016x" "$1")"
+  for byte_index in $(seq 0 7 | sort -r); do
+    echo -ne "\\x${hex:$(( byte_index * 2)):2}" >> "$2"
+  done
+}
+
+# Writes a string zero-padded to a fixed length
+# $1 = String
+# $2 = Length
+# $3 = Output file
+function _write_str()
+{
+  echo -n "$1" >> "$3"
+  head -c "$(( $2 - ${#1} ))" /dev/zero >> "$3"
+}
+
 # Concatenates binary files and filesystem to create fim image
 # $1 = Path to system image
 # $2 = Output file name
+#
+# [boot][toc][helpers...][reserved][size_img][img]
+# The table of contents has the layout:
+# magic[8] count[8] offset_end[8]
+# entries[32]{ name[32] sha256[64] offset[8] size[8] size_decompressed[8] codec[8] }
+# Helpers are stored zstd compressed (codec 1), they are decompressed once on extraction
 function _create_elf()
 {
   local img="$1"
   local out="$2"
+  local binaries=(bin/{bash,busybox,bwrap,ciopfs,dwarfs_aio,fim_image,fim_portal,fim_portal_daemon,fim_bwrap_apparmor,janitor,lsof,overlayfs,unionfs,proot})
+  local toc_max_entries=32
+  local toc_size_entry=128
+  local dir_compressed="$(mktemp -d)"
+  local toc_size=$(( 24 + toc_max_entries * toc_size_entry ))
+
+  # Compress helpers
+  for binary in "${binaries[@]}"; do
+    zstd -19 -q -f -o "$dir_compressed/$(basename "$binary")" "$binary"
+  done
 
   # Boot is the program on top of the image
   cp bin/boot "$out"
+  # Helpers start after the table of contents
+  local offset="$(( $(du -b "$out" | awk '{print $1}') + toc_size ))"
+  # Write table of contents header
+  echo -n "FIMTOC02" >> "$out"
+  _write_u64 "${#binaries[@]}" "$out"
+  local offset_end="$offset"
+  for binary in "${binaries[@]}"; do
+    offset_end="$(( offset_end + $(du -b "$dir_compressed/$(basename "$binary")" | awk '{print $1}') ))"
+  done
+  _write_u64 "$offset_end" "$out"
+  # Write table of contents entries
+  for binary in "${binaries[@]}"; do
+    local size="$(du -b "$dir_compressed/$(basename "$binary")" | awk '{print $1}')"
+    _write_str "$(basename "$binary")" 32 "$out"
+    _write_str "$(sha256sum "$binary" | awk '{print $1}')" 64 "$out"
+    _write_u64 "$offset" "$out"
+    _write_u64 "$size" "$out"
+    _write_u64 "$(du -b "$binary" | awk '{print $1}')" "$out"
+    _write_u64 1 "$out"
+    offset="$(( offset + size ))"
+  done
+  head -c "$(( (toc_max_entries - ${#binaries[@]}) * toc_size_entry ))" /dev/zero >> "$out"
   # Append binaries
-  for binary in bin/{bash,busybox,bwrap,ciopfs,dwarfs_aio,fim_portal,fim_portal_daemon,fim_bwrap_apparmor,janitor,lsof,overlayfs,unionfs,proot}; do
-    hex_size_binary="$( du -b "$binary" | awk '{print $1}' | xargs -I{} printf "%016x\n" {} )"
-    # Write binary size
-    for byte_index in $(seq 0 7 | sort -r); do
-      local byte="${hex_size_binary:$(( byte_index * 2)):2}"
-      echo -ne "\\x$byte" >> "$out"
-    done
-    # Append binary
-    cat "$binary" >> "$out"
+  for binary in "${binaries[@]}"; do
+    cat "$dir_compressed/$(basename "$binary")" >> "$out"
   done
+  rm -rf "$dir_compressed"
   # Create reserved space
   dd if=/dev/zero of="$out" bs=1 count=2097152 oflag=append conv=notrunc
   # Write size of image rightafter
-  size_img="$( du -b "$img" | awk '{print $1}' | xargs -I{} printf "%016x\n" {} )"
-  for byte_index in $(seq 0 7 | sort -r); do
-    local byte="${size_img:$(( byte_index * 2)):2}"
-    echo -ne "\\x$byte" >> "$out"
-  done
+  _write_u64 "$(du -b "$img" | awk '{print $1}')" "$out"
   # Write image
   cat "$img" >> "$out"
 
@@ -136,6 +182,7 @@ function _create_subsystem_blueprint()
     docker build . --build-arg FIM_DIST=BLUEPRINT --build-arg FIM_DIR="$(pwd)" -t flatimage-boot -f docker/Dockerfile.boot
     docker run --rm -v "$FIM_DIR_BUILD":"/host" flatimage-boot cp "$FIM_DIR"/src/boot/build/Release/boot /host/bin
     docker run --rm -v "$FIM_DIR_BUILD":"/host" flatimage-boot cp "$FIM_DIR"/src/boot/janitor /host/bin
+    docker run --rm -v "$FIM_DIR_BUILD":"/host" flatimage-boot cp "$FIM_DIR"/src/boot/fim_image /host/bin
   )
 
   # Compile and include portal
@@ -245,6 +292,7 @@ function _create_subsystem_alpine()
     docker build . --build-arg FIM_DIST=ALPINE --build-arg FIM_DIR="$(pwd)" -t flatimage-boot -f docker/Dockerfile.boot
     docker run --rm -v "$FIM_DIR_BUILD":"/host" flatimage-boot cp "$FIM_DIR"/src/boot/build/Release/boot /host/bin
     docker run --rm -v "$FIM_DIR_BUILD":"/host" flatimage-boot cp "$FIM_DIR"/src/boot/janitor /host/bin
+    docker run --rm -v "$FIM_DIR_BUILD":"/host" flatimage-boot cp "$FIM_DIR"/src/boot/fim_image /host/bin
   )
 
   # Compile and include portal
@@ -462,6 +510,7 @@ function _create_subsystem_arch()
     docker build . --build-arg FIM_DIST=ARCH --build-arg FIM_DIR="$(pwd)" -t flatimage-boot -f docker/Dockerfile.boot
     docker run --rm -v "$FIM_DIR_BUILD":"/host" flatimage-boot cp "$FIM_DIR"/src/boot/build/Release/boot /host/bin
     docker run --rm -v "$FIM_DIR_BUILD":"/host" flatimage-boot cp "$FIM_DIR"/src/boot/janitor /host/bin
+    docker run --rm -v "$FIM_DIR_BUILD":"/host" flatimage-boot cp "$FIM_DIR"/src/boot/fim_image /host/bin
   )
 
   # Compile and include portal
@@ -0,0 +1,50 @@
+#!/usr/bin/env bash
+
+######################################################################
+# @author      : Ruan E. Formigoni (ruanformigoni@gmail.com)
+# @file        : bench-dwarfs-profiles
+#
+# @description : Compares the dwarfs mount presets on a flatimage by
+#                the wall time of a command that reads its files
+######################################################################
+
+# Usage: bench-dwarfs-profiles.sh <image> [iterations] [command...]
+# e.g.: bench-dwarfs-profiles.sh ./app.flatimage 10 find / -xdev -type f -exec cat {} +
+
+set -e
+
+FILE_IMAGE="$(realpath "$1")"
+declare -i ITERATIONS="${2:-10}"
+shift 2 || shift $#
+COMMAND=("${@:-find /usr -xdev -type f -exec cat {} +}")
+
+DIR_BENCH="$(mktemp -d)"
+trap 'rm -rf "$DIR_BENCH"' EXIT
+
+# Drops the page cache when running as root, so each run reads the image from disk
+function _drop_caches()
+{
+  sync
+  [ "$(id -u)" -eq 0 ] && echo 3 > /proc/sys/vm/drop_caches || true
+}
+
+# Runs the command ITERATIONS times with the preset and prints the mean wall time and peak rss
+function _bench()
+{
+  local preset="$1"
+  local image="$DIR_BENCH/$preset.flatimage"
+  cp "$FILE_IMAGE" "$image"
+  [ "$preset" = "default" ] || "$image" fim-dwarfs preset "$preset"
+  local total=0
+  for (( i=0; i < ITERATIONS; ++i )); do
+    _drop_caches
+    local start="$(date +%s%N)"
+    "$image" fim-exec "${COMMAND[@]}" &>/dev/null || true
+    total=$(( total + $(date +%s%N) - start ))
+  done
+  echo "$preset: $(( total / ITERATIONS / 1000000 )) ms per run"
+}
+
+for preset in default latency throughput low-memory; do
+  _bench "$preset"
+done
@@ -0,0 +1,54 @@
+#!/usr/bin/env bash
+
+######################################################################
+# @author      : Ruan E. Formigoni (ruanformigoni@gmail.com)
+# @file        : bench-helper-exec
+#
+# @description : Compares the per-exec startup of an upx packed helper
+#                with the same helper decompressed once from zstd
+######################################################################
+
+# Usage: bench-helper-exec.sh <helper> [iterations] [args...]
+# e.g.: bench-helper-exec.sh ./bin/bwrap 200 --version
+
+set -e
+
+FILE_HELPER="$(realpath "$1")"
+declare -i ITERATIONS="${2:-100}"
+shift 2 || shift $#
+ARGS=("${@:---version}")
+
+DIR_BENCH="$(mktemp -d)"
+trap 'rm -rf "$DIR_BENCH"' EXIT
+
+# Create both variants from the same helper
+cp "$FILE_HELPER" "$DIR_BENCH/plain"
+upx -qq -d "$DIR_BENCH/plain" &>/dev/null || true
+cp "$DIR_BENCH/plain" "$DIR_BENCH/upx"
+upx -qq -6 --no-lzma "$DIR_BENCH/upx"
+zstd -q -19 -o "$DIR_BENCH/plain.zst" "$DIR_BENCH/plain"
+
+# Decompress once, as relocate() does on the first launch
+start="$(date +%s%N)"
+zstd -q -d -f -o "$DIR_BENCH/zstd" "$DIR_BENCH/plain.zst"
+chmod +x "$DIR_BENCH/zstd"
+echo "zstd one-time decompression: $(( ($(date +%s%N) - start) / 1000 )) us"
+
+# Runs the variant ITERATIONS times and prints the mean wall time per exec
+function _bench()
+{
+  local file="$1"
+  local start="$(date +%s%N)"
+  for (( i=0; i < ITERATIONS; ++i )); do
+    "$file" "${ARGS[@]}" &>/dev/null || true
+  done
+  echo "$(basename "$file"): $(( ($(date +%s%N) - start) / ITERATIONS / 1000 )) us per exec" \
+    "($(du -b "$file" | awk '{print $1}') bytes)"
+}
+
+# Warm up the page cache
+"$DIR_BENCH/upx" "${ARGS[@]}" &>/dev/null || true
+"$DIR_BENCH/zstd" "${ARGS[@]}" &>/dev/null || true
+
+_bench "$DIR_BENCH/upx"
+_bench "$DIR_BENCH/zstd"
@@ -24,16 +24,25 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <fcntl.h>
 #include <filesystem>
+#include <thread>
+#include <atomic>
+#include <utility>
 
 #include "../cpp/lib/linux.hpp"
 #include "../cpp/lib/env.hpp"
 #include "../cpp/lib/log.hpp"
 #include "../cpp/lib/elf.hpp"
+#include "../cpp/lib/payload.hpp"
+#include "../cpp/lib/trace.hpp"
+
+#include "manifest.hpp"
 
 #include "config/config.hpp"
 #include "parser.hpp"
 #include "portal.hpp"
+#include "scheduler.hpp"
 
 // Unix environment variables
 extern char** environ;
@@ -81,6 +90,7 @@ void relocate(char** argv)
   // This part of the code is executed to write the runner,
   // rightafter the code is replaced by the runner.
   // This is done because the current executable cannot mount itself.
+  ns_trace::begin("relocate");
 
   // Get path to called executable
   ethrow_if(!std::filesystem::exists("/proc/self/exe"), "Error retrieving executable path for self");
@@ -138,105 +148,172 @@ void relocate(char** argv)
     , "Could not mount directory '{}'"_fmt(path_dir_mount_ext)
   );
 
-  // Starting offsets
-  uint64_t offset_beg = 0;
-  uint64_t offset_end = ns_elf::skip_elf_header(path_absolute.c_str());
+  // Helpers extracted on boot, the remaining ones are extracted on first use by search_path
+  std::vector<std::string> vec_name_helper_eager
+  {
+    "bash", "busybox", "bwrap", "dwarfs_aio", "fim_portal", "fim_portal_daemon", "janitor"
+  };
+  if ( ns_env::exists("FIM_FUSE_OVERLAYFS", "1") ) { vec_name_helper_eager.push_back("overlayfs"); }
+  if ( ns_env::exists("FIM_FUSE_UNIONFS", "1") ) { vec_name_helper_eager.push_back("unionfs"); }
+  if ( ns_env::exists("FIM_CASEFOLD", "1") ) { vec_name_helper_eager.push_back("ciopfs"); }
 
-  // Write by binary header offset
-  auto f_write_from_header = [&](fs::path path_file, uint64_t offset_end)
+  // Sets the start of the filesystem and replaces this process with the runner
+  auto start = std::chrono::high_resolution_clock::now();
+  bool is_relocate_open = true;
+  auto f_launch = [&](uint64_t offset_end, int fd_boot)
   {
-    // Update offsets
-    offset_beg = offset_end;
-    offset_end = ns_elf::skip_elf_header(path_absolute.c_str(), offset_beg) + offset_beg;
-    // Write binary only if it doesnt already exist
-    if ( ! fs::exists(path_file) )
+    // Filesystem starts here
+    ns_env::set("FIM_OFFSET", std::to_string(offset_end).c_str(), ns_env::Replace::Y);
+    ns_log::debug()("FIM_OFFSET: {}", offset_end);
+
+    // Option to show offset and exit (to manually mount the fs with fuse2fs)
+    if( getenv("FIM_MAIN_OFFSET") ){ println(offset_end); exit(0); }
+
+    // The portal derives its key from the inode of this file, it must be unique per instance
+    int fd_key = open((path_dir_instance / "fim_boot").c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0660);
+    ethrow_if(fd_key < 0, "Could not create portal key file: {}"_fmt(strerror(errno)));
+    close(fd_key);
+
+    // Destructors do not run on execve, the span is closed once when a failed warm boot falls
+    // through to the extraction
+    if ( std::exchange(is_relocate_open, false) ) { ns_trace::end("relocate"); }
+
+    // Launch Runner from memory
+    if ( fd_boot >= 0 )
     {
-      ns_elf::copy_binary(path_absolute.string(), path_file, {offset_beg, offset_end});
-    }
-    // Set permissions
-    fs::permissions(path_file.c_str(), fs::perms::owner_all | fs::perms::group_all);
-    // Return new values for offsets
-    return std::make_pair(offset_beg, offset_end);
+      fcntl(fd_boot, F_SETFD, FD_CLOEXEC);
+      fexecve(fd_boot, argv, environ);
+      "Could not execute boot program from memory: {}"_throw(strerror(errno));
+    } // if
+
+    // Launch Runner
+    execve((path_dir_app_bin / "fim_boot").c_str(), argv, environ);
+    ns_log::error()("Could not execute boot program: {}", strerror(errno));
   };
 
-  // Write by binary byte offset
-  auto f_write_from_offset = [&](std::ifstream& file_binary, fs::path path_file, uint64_t offset_end)
+  // Warm boot, the manifest agrees with the extracted helpers
+  // With FIM_MEMFD=1, the helpers that do not run in the container are loaded in memory
+  bool is_memfd = ns_payload::is_memfd();
+  fs::path path_file_manifest = path_dir_app / "manifest.json";
+  std::error_code ec;
+  if ( not is_memfd )
   {
-    uint64_t offset_beg = offset_end;
-    // Set file position
-    file_binary.seekg(offset_beg);
-    // Read size bytes (FATAL if fails)
-    uint64_t size;
-    ethrow_if(not file_binary.read(reinterpret_cast<char*>(&size), sizeof(size)), "Could not read binary size");
-    // Open output file and write 
-    if ( lec(fs::exists, path_file) )
+    auto expected_manifest = ns_manifest::read(path_file_manifest);
+    auto error = (expected_manifest)?
+        ns_manifest::validate(*expected_manifest, path_absolute, path_dir_busybox, vec_name_helper_eager)
+      : std::make_optional(expected_manifest.error());
+    if ( not error )
     {
-      file_binary.seekg(offset_beg + size + sizeof(size));
+      ns_log::debug()("Warm boot from manifest");
+      ns_trace::instant("warm boot");
+      f_launch(expected_manifest->offset_end, -1);
+      // Only reached if the runner could not be executed
     } // if
-    else
+    // Repair through a full extraction, which re-writes the manifest
+    ns_log::debug()("Manifest rejected, extracting helpers: {}", error.value_or("execve failed"));
+    fs::remove(path_file_manifest, ec);
+  } // if
+
+  // Write binaries
+  ns_trace::begin("extract");
+  int fd_binary = open(path_absolute.c_str(), O_RDONLY | O_CLOEXEC);
+  ethrow_if(fd_binary < 0, "Could not open flatimage binary file: {}"_fmt(strerror(errno)));
+
+  // Read the table of contents of the helpers appended after the boot program
+  auto expected_toc = ns_payload::read(path_absolute);
+  ethrow_if(not expected_toc, expected_toc.error());
+  uint64_t offset_end = expected_toc->offset_end;
+
+  // Each job is the output file and the range [offset, offset+size) of it in the binary
+  std::vector<std::pair<fs::path,ns_payload::Entry>> vec_jobs;
+  ns_payload::Entry entry_boot{};
+  std::strncpy(entry_boot.name, "fim_boot", sizeof(entry_boot.name));
+  entry_boot.offset = 0;
+  entry_boot.size = ns_elf::skip_elf_header(path_absolute.c_str());
+  vec_jobs.emplace_back(path_dir_app_bin / "fim_boot", entry_boot);
+  for(auto&& name_helper : vec_name_helper_eager)
+  {
+    auto opt_entry = ns_payload::find(*expected_toc, name_helper);
+    ethrow_if(not opt_entry, "Could not find '{}' in the table of contents"_fmt(name_helper));
+    auto opt_path_file_helper = ns_payload::path_file_target(name_helper);
+    ethrow_if(not opt_path_file_helper, "Could not find target directory for '{}'"_fmt(name_helper));
+    vec_jobs.emplace_back(*opt_path_file_helper, *opt_entry);
+  } // for
+
+  // Extract the binaries that do not exist yet, spread across the available cores
+  std::atomic_size_t index_job{0};
+  std::vector<std::error<std::string>> vec_errors(vec_jobs.size());
+  std::vector<int> vec_fds(vec_jobs.size(), -1);
+  auto f_worker = [&]
+  {
+    for(size_t i = index_job++; i < vec_jobs.size(); i = index_job++)
     {
-      // Read binary
-      std::vector<char> buffer(size);
-      ethrow_if(not file_binary.read(buffer.data(), size), "Could not read binary");
-      // Open output binary file
-      std::ofstream of{path_file, std::ios::out | std::ios::binary};
-      ethrow_if(not of.is_open(), "Could not open output file '{}'"_fmt(path_file));
-      // Write binary
-      ethrow_if(not of.write(buffer.data(), size), "Could not write binary file '{}'"_fmt(path_file));
-      // Set permissions
-      lec(fs::permissions, path_file.c_str(), fs::perms::owner_all | fs::perms::group_all);
-    } // if
-    // Return new values for offsets
-    return std::make_pair(offset_beg, file_binary.tellg());
+      auto const& [path_file, entry] = vec_jobs[i];
+      if ( is_memfd and not ns_payload::is_guest(entry.get_name()) )
+      {
+        auto expected_fd = ns_payload::memfd(fd_binary, entry);
+        if ( expected_fd ) { vec_fds[i] = *expected_fd; } else { vec_errors[i] = expected_fd.error(); }
+        continue;
+      } // if
+      // The boot program is cached once per version, helpers are linked from the store
+      vec_errors[i] = (i == 0)? ns_payload::publish_once(fd_binary, entry, path_file)
+        : ns_payload::extract(fd_binary, entry, path_file);
+    } // for
   };
+  std::vector<std::jthread> vec_workers;
+  for(uint32_t i = 0; i < std::clamp(std::thread::hardware_concurrency(), 1u, uint32_t(vec_jobs.size())); ++i)
+  {
+    vec_workers.emplace_back(f_worker);
+  } // for
+  vec_workers.clear();
+  close(fd_binary);
 
-  // Write binaries
-  auto start = std::chrono::high_resolution_clock::now();
-  fs::path path_file_dwarfs_aio = path_dir_app_bin / "dwarfs_aio";
-  std::ifstream file_binary{path_absolute, std::ios::in | std::ios::binary};
-  ethrow_if(not file_binary.is_open(), "Could not open flatimage binary file");
-  std::tie(offset_beg, offset_end) = f_write_from_header(path_dir_instance / "fim_boot" , 0);
-  std::tie(offset_beg, offset_end) = f_write_from_offset(file_binary, path_dir_app_bin / "bash", offset_end);
-  std::tie(offset_beg, offset_end) = f_write_from_offset(file_binary, path_dir_busybox / "busybox", offset_end);
-  std::tie(offset_beg, offset_end) = f_write_from_offset(file_binary, path_dir_app_bin / "bwrap", offset_end);
-  std::tie(offset_beg, offset_end) = f_write_from_offset(file_binary, path_dir_app_bin / "ciopfs", offset_end);
-  std::tie(offset_beg, offset_end) = f_write_from_offset(file_binary, path_file_dwarfs_aio, offset_end);
-  std::tie(offset_beg, offset_end) = f_write_from_offset(file_binary, path_dir_app_bin / "fim_portal", offset_end);
-  std::tie(offset_beg, offset_end) = f_write_from_offset(file_binary, path_dir_app_bin / "fim_portal_daemon", offset_end);
-  std::tie(offset_beg, offset_end) = f_write_from_offset(file_binary, path_dir_app_bin / "fim_bwrap_apparmor", offset_end);
-  std::tie(offset_beg, offset_end) = f_write_from_offset(file_binary, path_dir_app_bin / "janitor", offset_end);
-  std::tie(offset_beg, offset_end) = f_write_from_offset(file_binary, path_dir_app_bin / "lsof", offset_end);
-  std::tie(offset_beg, offset_end) = f_write_from_offset(file_binary, path_dir_app_bin / "overlayfs", offset_end);
-  std::tie(offset_beg, offset_end) = f_write_from_offset(file_binary, path_dir_app_bin / "unionfs", offset_end);
-  std::tie(offset_beg, offset_end) = f_write_from_offset(file_binary, path_dir_app_bin / "proot", offset_end);
-  file_binary.close();
-  std::error_code ec;
-  fs::create_symlink(path_file_dwarfs_aio, path_dir_app_bin / "dwarfs", ec);
-  fs::create_symlink(path_file_dwarfs_aio, path_dir_app_bin / "mkdwarfs", ec);
-  auto end = std::chrono::high_resolution_clock::now();
+  // Check for extraction errors
+  for(auto&& error : vec_errors)
+  {
+    ethrow_if(error, *error);
+  } // for
+
+  // Register the helpers loaded in memory, the registry is inherited through the environment
+  for(size_t i = 1; i < vec_jobs.size(); ++i)
+  {
+    qcontinue_if(vec_fds[i] < 0);
+    ns_payload::memfd_register(vec_jobs[i].second.get_name(), vec_fds[i]);
+  } // for
+  std::ignore = ns_payload::memfd_alias("dwarfs", "dwarfs_aio");
+  std::ignore = ns_payload::memfd_alias("mkdwarfs", "dwarfs_aio");
+  if ( is_memfd ) { ns_payload::memfd_export(); }
+
+  fs::create_symlink(path_dir_app_bin / "dwarfs_aio", path_dir_app_bin / "dwarfs", ec);
+  fs::create_symlink(path_dir_app_bin / "dwarfs_aio", path_dir_app_bin / "mkdwarfs", ec);
 
   // Create busybox symlinks, allow (symlinks exists) errors
   for(auto const& busybox_applet : arr_busybox_applet)
   {
     fs::create_symlink(path_dir_busybox / "busybox", path_dir_busybox / busybox_applet, ec);
   } // for
+  auto end = std::chrono::high_resolution_clock::now();
+  ns_trace::end("extract");
 
-  // Filesystem starts here
-  ns_env::set("FIM_OFFSET", std::to_string(offset_end).c_str(), ns_env::Replace::Y);
-  ns_log::debug()("FIM_OFFSET: {}", offset_end);
-
-  // Option to show offset and exit (to manually mount the fs with fuse2fs)
-  if( getenv("FIM_MAIN_OFFSET") ){ println(offset_end); exit(0); }
+  // Record the extracted helpers for the next boot
+  if ( not is_memfd )
+  {
+    auto expected_manifest = ns_manifest::create(offset_end, path_absolute, path_dir_busybox, vec_name_helper_eager);
+    auto error = (expected_manifest)? ns_manifest::write(path_file_manifest, *expected_manifest)
+      : std::make_optional(expected_manifest.error());
+    elog_if(error, *error);
+  } // if
 
   // Print copy duration
   if ( getenv("FIM_DEBUG") != nullptr )
   {
     auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
-    "Copy binaries finished in '{}' ms"_print(elapsed.count());
+    "Copy binaries finished in '{}' ms ('{}' helpers deferred)\n"_print(elapsed.count()
+      , expected_toc->count - vec_name_helper_eager.size()
+    );
   } // if
 
-  // Launch Runner
-  execve("{}/fim_boot"_fmt(path_dir_instance).c_str(), argv, environ);
+  f_launch(offset_end, vec_fds.front());
 } // relocate() }}}
 
 // boot() {{{
@@ -244,19 +321,34 @@ std::unique_ptr<ns_config::FlatimageConfig> boot(int argc, char** argv)
 {
 
   // Setup environment variables
+  ns_trace::begin("config");
   auto config = std::make_unique<ns_config::FlatimageConfig>(ns_config::config());
+  ns_trace::end("config");
 
 
   // Set log file
   ns_log::set_sink_file(config->path_dir_mount.string() + ".boot.log");
 
-  // Start portal
-  ns_portal::Portal portal = ns_portal::Portal(config->path_dir_instance / "fim_boot");
+  // Read by the guest to send commands to the portal daemon, the environment is not modified
+  // while other threads run
+  ns_env::set("FIM_PORTAL_FILE", config->path_dir_instance / "fim_boot", ns_env::Replace::Y);
 
-  // Refresh desktop integration
-  ns_log::exception([&]{ ns_desktop::integrate(*config); });
+  // Start portal and refresh desktop integration, which do not depend on each other
+  // The portal daemon dies with the thread that spawned it, so it starts in this thread
+  std::unique_ptr<ns_portal::Portal> portal;
+  ns_scheduler::Scheduler scheduler;
+  std::ignore = scheduler.add("portal", {}, [&]
+  {
+    portal = std::make_unique<ns_portal::Portal>(config->path_dir_instance / "fim_boot");
+  }, ns_scheduler::Affinity::MAIN);
+  std::ignore = scheduler.add("desktop integrate", {}, [&]
+  {
+    ns_log::exception([&]{ ns_desktop::integrate(*config); });
+  });
+  scheduler.run();
 
   // Parse flatimage command if exists
+  ns_trace::Span span("command");
   ns_parser::parse_cmds(*config, argc, argv);
 
   return config;
@@ -289,7 +381,8 @@ int main(int argc, char** argv)
   ereturn_if(not expected_path_file_self, expected_path_file_self.error(), EXIT_FAILURE);
 
   // If it is outside /tmp, move the binary
-  fs::path path_file_self = *expected_path_file_self;
+  // The link target is not a valid path when the boot program runs from memory
+  fs::path path_file_self = "/proc/self/exe";
   if ( fs::file_size(path_file_self) != ns_elf::skip_elf_header(path_file_self) )
   {
     ns_log::debug()("Relocating binary");
@@ -298,6 +391,9 @@ int main(int argc, char** argv)
     return EXIT_FAILURE;
   } // if
 
+  // Helpers in memory are only visible to the boot program
+  ns_payload::memfd_import();
+
   // Boot the main program
   if ( auto expected_config = ns_exception::to_expected([&]{ return boot(argc, argv); }); expected_config )
   {
@@ -0,0 +1,188 @@
+///
+// @author      : Ruan E. Formigoni (ruanformigoni@gmail.com)
+// @file        : cache
+///
+
+#pragma once
+
+#include <filesystem>
+#include <fstream>
+#include <numeric>
+#include <algorithm>
+#include <nlohmann/json.hpp>
+
+#include "../cpp/lib/log.hpp"
+#include "../cpp/lib/env.hpp"
+#include "../cpp/std/exception.hpp"
+#include "../cpp/macro.hpp"
+#include "../cpp/common.hpp"
+
+// Each dwarfs daemon has its own block cache, the boot computes a single budget from the available
+// memory and splits it across the layers. With FIM_CACHE_REBALANCE=1 the split follows the reads of
+// the daemons in the last launch, which are only known for daemons of this instance, so the layers
+// are not shared with other instances.
+namespace ns_cache
+{
+
+namespace
+{
+
+namespace fs = std::filesystem;
+
+using json_t = nlohmann::json;
+
+constexpr uint64_t const MIB = 1 << 20;
+// Bounds of the total budget
+constexpr uint64_t const SIZE_BUDGET_MIN = 64 * MIB;
+constexpr uint64_t const SIZE_BUDGET_MAX = 2048 * MIB;
+// Smallest cache of a layer
+constexpr uint64_t const SIZE_LAYER_MIN = 8 * MIB;
+
+// read_u64() {{{
+// Reads the first number of a file, nullopt if it does not contain one, e.g., 'max' in cgroups
+inline std::optional<uint64_t> read_u64(fs::path const& path_file)
+{
+  std::ifstream file(path_file);
+  uint64_t value;
+  qreturn_if(not (file >> value), std::nullopt);
+  return value;
+} // read_u64() }}}
+
+// available_meminfo() {{{
+inline std::optional<uint64_t> available_meminfo()
+{
+  std::ifstream file("/proc/meminfo");
+  std::string key;
+  uint64_t value;
+  std::string unit;
+  while ( file >> key >> value >> unit )
+  {
+    qreturn_if(key == "MemAvailable:", value * 1024);
+  } // while
+  return std::nullopt;
+} // available_meminfo() }}}
+
+// available_cgroup() {{{
+// Memory left until the limit of the cgroup of the process, nullopt if it is not limited
+inline std::optional<uint64_t> available_cgroup()
+{
+  std::ifstream file("/proc/self/cgroup");
+  std::string line;
+  while ( std::getline(file, line) )
+  {
+    // cgroup v2 has a single hierarchy with the id 0
+    if ( line.starts_with("0::") )
+    {
+      fs::path path_dir_cgroup = fs::path{"/sys/fs/cgroup"} / line.substr(3).erase(0, 1);
+      auto opt_max = read_u64(path_dir_cgroup / "memory.max");
+      auto opt_current = read_u64(path_dir_cgroup / "memory.current");
+      qreturn_if(not opt_max or not opt_current, std::nullopt);
+      return (*opt_max > *opt_current)? *opt_max - *opt_current : 0;
+    } // if
+  } // while
+  // cgroup v1, an unlimited group reports a value close to the maximum integer
+  auto opt_limit = read_u64("/sys/fs/cgroup/memory/memory.limit_in_bytes");
+  auto opt_usage = read_u64("/sys/fs/cgroup/memory/memory.usage_in_bytes");
+  qreturn_if(not opt_limit or not opt_usage or *opt_limit >= (uint64_t{1} << 62), std::nullopt);
+  return (*opt_limit > *opt_usage)? *opt_limit - *opt_usage : 0;
+} // available_cgroup() }}}
+
+} // namespace
+
+// budget() {{{
+// Total size of the dwarfs caches, an eighth of the available memory unless FIM_CACHE_SIZE sets
+// it in MiB
+[[nodiscard]] inline uint64_t budget()
+{
+  if ( auto opt_size = ns_env::get_optional("FIM_CACHE_SIZE") )
+  {
+    auto expected_size = ns_exception::to_expected([&]{ return std::stoull(std::string{*opt_size}); });
+    if ( expected_size ) { return std::max(*expected_size * MIB, SIZE_LAYER_MIN); }
+    ns_log::error()("Invalid FIM_CACHE_SIZE '{}'", *opt_size);
+  } // if
+  uint64_t size_available = std::min(available_meminfo().value_or(SIZE_BUDGET_MAX * 8)
+    , available_cgroup().value_or(std::numeric_limits<uint64_t>::max())
+  );
+  uint64_t size_budget = std::clamp(size_available / 8, SIZE_BUDGET_MIN, SIZE_BUDGET_MAX);
+  ns_log::debug()("Available memory is {} MiB, cache budget is {} MiB", size_available / MIB, size_budget / MIB);
+  return size_budget;
+} // budget() }}}
+
+// split() {{{
+// Splits the budget across layers by their size, when the bytes read by each layer in a previous
+// launch are known, half of the budget follows the observed access share. The floor of each layer
+// is reserved first so the sum never exceeds the budget
+[[nodiscard]] inline std::vector<uint64_t> split(uint64_t size_budget
+  , std::vector<uint64_t> const& vec_size_layer
+  , std::vector<uint64_t> const& vec_bytes_read = {})
+{
+  auto f_share = [](std::vector<uint64_t> const& vec, size_t i)
+  {
+    uint64_t total = std::reduce(vec.begin(), vec.end(), uint64_t{0});
+    return (total == 0)? 1.0 / vec.size() : double(vec[i]) / total;
+  };
+  bool is_observed = vec_bytes_read.size() == vec_size_layer.size()
+    and std::ranges::any_of(vec_bytes_read, [](auto&& e){ return e > 0; });
+  std::vector<uint64_t> vec_size_cache;
+  qreturn_if(vec_size_layer.empty(), vec_size_cache);
+  uint64_t size_floor = std::min(SIZE_LAYER_MIN, size_budget / vec_size_layer.size());
+  uint64_t size_remainder = size_budget - size_floor * vec_size_layer.size();
+  for(size_t i = 0; i < vec_size_layer.size(); ++i)
+  {
+    double share = is_observed?
+        0.5 * f_share(vec_size_layer, i) + 0.5 * f_share(vec_bytes_read, i)
+      : f_share(vec_size_layer, i);
+    vec_size_cache.push_back(size_floor + uint64_t(share * size_remainder));
+  } // for
+  return vec_size_cache;
+} // split() }}}
+
+// bytes_read() {{{
+// Bytes a daemon read from its image, its access share
+[[nodiscard]] inline std::optional<uint64_t> bytes_read(pid_t pid)
+{
+  std::ifstream file("/proc/{}/io"_fmt(pid));
+  std::string key;
+  uint64_t value;
+  while ( file >> key >> value )
+  {
+    qreturn_if(key == "rchar:", value);
+  } // while
+  return std::nullopt;
+} // bytes_read() }}}
+
+// read_usage() {{{
+// Bytes read by each layer in the previous launch, empty if the layers changed since
+[[nodiscard]] inline std::vector<uint64_t> read_usage(fs::path const& path_file_usage
+  , std::vector<uint64_t> const& vec_size_layer)
+{
+  std::ifstream file(path_file_usage);
+  qreturn_if(not file.is_open(), {});
+  json_t json = json_t::parse(file, nullptr, false);
+  qreturn_if(json.is_discarded(), {});
+  auto expected_usage = ns_exception::to_expected([&]
+  {
+    return std::make_pair(json.at("sizes").get<std::vector<uint64_t>>(), json.at("bytes_read").get<std::vector<uint64_t>>());
+  });
+  ereturn_if(not expected_usage, "Invalid cache usage file: {}"_fmt(expected_usage.error()), {});
+  dreturn_if(expected_usage->first != vec_size_layer, "Layers changed since the last cache usage record", {});
+  return expected_usage->second;
+} // read_usage() }}}
+
+// write_usage() {{{
+[[nodiscard]] inline std::error<std::string> write_usage(fs::path const& path_file_usage
+  , std::vector<uint64_t> const& vec_size_layer
+  , std::vector<uint64_t> const& vec_bytes_read)
+{
+  json_t json;
+  json["sizes"] = vec_size_layer;
+  json["bytes_read"] = vec_bytes_read;
+  std::ofstream file(path_file_usage, std::ios::trunc);
+  qreturn_if(not file.is_open(), "Could not open '{}' for writing"_fmt(path_file_usage));
+  file << json.dump(2);
+  return std::nullopt;
+} // write_usage() }}}
+
+} // namespace ns_cache
+
+/* vim: set expandtab fdm=marker ts=2 sw=2 tw=100 et :*/
@@ -0,0 +1,119 @@
+///
+// @author      : Ruan E. Formigoni (ruanformigoni@gmail.com)
+// @file        : bench
+///
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <fstream>
+#include <filesystem>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "../../cpp/lib/log.hpp"
+#include "../../cpp/lib/fuse.hpp"
+#include "../../cpp/macro.hpp"
+#include "../../cpp/common.hpp"
+
+// Measures the parallel read throughput of the mounted layers, to compare the fuse tuning of
+// FIM_FUSE_TUNING_<BACKEND> and the dwarfs profiles on a given machine
+namespace ns_cmd::ns_bench
+{
+
+struct CmdBench
+{
+  uint32_t count_threads;
+};
+
+namespace
+{
+
+namespace fs = std::filesystem;
+
+// files() {{{
+// Regular files in the mountpoints of the layers, which are symlinks if the layers are shared
+inline std::vector<fs::path> files(fs::path const& path_dir_mount_layers)
+{
+  std::error_code ec;
+  std::vector<fs::path> vec_path_file;
+  for(auto&& entry_layer : fs::directory_iterator(path_dir_mount_layers, ec))
+  {
+    for(auto&& entry : fs::recursive_directory_iterator(entry_layer.path(), ec))
+    {
+      qcontinue_if(entry.is_symlink(ec) or not entry.is_regular_file(ec));
+      vec_path_file.push_back(entry.path());
+    } // for
+  } // for
+  return vec_path_file;
+} // files() }}}
+
+} // namespace
+
+// read() {{{
+// Reads every file once with count_threads readers, returns the number of bytes read
+inline uint64_t read(std::vector<fs::path> const& vec_path_file, uint32_t count_threads)
+{
+  std::atomic<size_t> index{0};
+  std::atomic<uint64_t> bytes{0};
+  std::vector<std::jthread> vec_threads;
+  for(uint32_t t = 0; t < count_threads; ++t)
+  {
+    vec_threads.emplace_back([&]
+    {
+      std::vector<char> buffer(1 << 20);
+      for(size_t i = index++; i < vec_path_file.size(); i = index++)
+      {
+        int fd = open(vec_path_file[i].c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+        qcontinue_if(fd < 0);
+        ssize_t count;
+        while ( (count = ::read(fd, buffer.data(), buffer.size())) > 0 ) { bytes += count; }
+        close(fd);
+      } // for
+    });
+  } // for
+  for(auto&& thread : vec_threads) { thread.join(); }
+  return bytes.load();
+} // read() }}}
+
+// run() {{{
+// Reads every file of the layers once with count_threads readers
+inline void run(fs::path const& path_dir_mount_layers, uint32_t count_threads)
+{
+  std::vector<fs::path> vec_path_file = files(path_dir_mount_layers);
+  ethrow_if(vec_path_file.empty(), "No files to read in '{}'"_fmt(path_dir_mount_layers));
+  // Tuning applied to the layers
+  std::error_code ec;
+  for(auto&& entry : fs::directory_iterator(path_dir_mount_layers, ec))
+  {
+    auto expected_path_dir_connection = ns_fuse::connection(entry.path());
+    qcontinue_if(not expected_path_dir_connection);
+    std::ifstream file_max_background(*expected_path_dir_connection / "max_background");
+    std::ifstream file_congestion_threshold(*expected_path_dir_connection / "congestion_threshold");
+    uint32_t max_background{}, congestion_threshold{};
+    file_max_background >> max_background;
+    file_congestion_threshold >> congestion_threshold;
+    ns_log::info()("Layer '{}': max_background={} congestion_threshold={}"
+      , entry.path().filename()
+      , max_background
+      , congestion_threshold
+    );
+  } // for
+  // Read in parallel
+  auto time_begin = std::chrono::steady_clock::now();
+  uint64_t bytes = read(vec_path_file, count_threads);
+  auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - time_begin).count();
+  println("Read {} files ({} MiB) with {} threads in {}ms: {} MiB/s"
+    , vec_path_file.size()
+    , bytes >> 20
+    , count_threads
+    , ms
+    , (bytes >> 20) * 1000 / std::max<int64_t>(ms, 1)
+  );
+} // run() }}}
+
+} // namespace ns_cmd::ns_bench
+
+/* vim: set expandtab fdm=marker ts=2 sw=2 tw=100 et :*/
@@ -0,0 +1,105 @@
+///
+// @author      : Ruan E. Formigoni (ruanformigoni@gmail.com)
+// @file        : compression
+///
+
+#pragma once
+
+#include <array>
+#include <vector>
+#include <string>
+
+#include "../../cpp/std/vector.hpp"
+#include "../../cpp/macro.hpp"
+#include "../../cpp/common.hpp"
+#include "../config/config.hpp"
+
+// Compression profiles of the layers, a preset selected with FIM_COMPRESSION_PRESET and options
+// of FIM_COMPRESSION_OPTIONS that override it. They are passed to mkdwarfs by create and commit.
+namespace ns_cmd::ns_compression
+{
+
+namespace
+{
+
+// Option and value, an option may repeat, e.g., a compression per category
+using profile_t = std::vector<std::pair<std::string,std::string>>;
+
+// Long options of mkdwarfs that can be set in a profile
+constexpr std::array<std::string_view,7> const OPTIONS
+{
+  "compress-level", "num-workers", "block-size-bits", "window-size", "memory-limit", "categorize", "compression"
+};
+
+} // namespace
+
+// Presets, measure them on the files of an application with fim-layer probe
+// fast-start : Small blocks, a random read at startup decompresses less data
+// balanced   : Default level of mkdwarfs, stores already compressed media as is
+// smallest   : Highest level and every categorizer, slow to create and to decompress
+inline std::vector<std::pair<std::string,profile_t>> const PRESETS
+{
+    { "fast-start", {{"compress-level", "4"}, {"block-size-bits", "20"}, {"categorize", "incompressible"}, {"compression", "incompressible::null"}} }
+  , { "balanced", {{"compress-level", "7"}, {"categorize", "incompressible"}, {"compression", "incompressible::null"}} }
+  , { "smallest", {{"compress-level", "9"}, {"categorize", ""}} }
+};
+
+// parse() {{{
+// Parses a comma separated list of option=value pairs, categorize may be given without a value
+inline profile_t parse(std::string_view str_options)
+{
+  profile_t profile;
+  for(auto&& option : ns_vector::from_string(str_options, ','))
+  {
+    qcontinue_if(option.empty());
+    auto pos = option.find('=');
+    std::string key = option.substr(0, pos);
+    std::string value = (pos == std::string::npos)? "" : option.substr(pos+1);
+    ethrow_if(not std::ranges::contains(OPTIONS, key), "Unsupported compression option '{}'"_fmt(key));
+    ethrow_if(value.empty() and key != "categorize", "Option '{}' requires a value"_fmt(key));
+    profile.emplace_back(key, value);
+  } // for
+  return profile;
+} // parse() }}}
+
+// profile() {{{
+// Options of the preset, the level and the options replace the ones of the preset with the same name
+inline profile_t profile(std::string_view name_preset
+  , std::optional<uint32_t> opt_level
+  , std::string_view str_options)
+{
+  auto it = std::ranges::find(PRESETS, name_preset, [](auto&& e){ return e.first; });
+  ethrow_if(it == PRESETS.end(), "Unknown compression preset '{}'"_fmt(name_preset));
+  profile_t profile = it->second;
+  profile_t profile_override = parse(str_options);
+  if ( opt_level ) { profile_override.emplace(profile_override.begin(), "compress-level", std::to_string(*opt_level)); }
+  for(auto&& [key, value] : profile_override)
+  {
+    std::erase_if(profile, [&](auto&& e){ return e.first == key; });
+  } // for
+  std::ranges::copy(profile_override, std::back_inserter(profile));
+  return profile;
+} // profile() }}}
+
+// args() {{{
+// Arguments of mkdwarfs for the profile
+inline std::vector<std::string> args(profile_t const& profile)
+{
+  return profile
+    | std::views::transform([](auto&& e){ return e.second.empty()? "--{}"_fmt(e.first) : "--{}={}"_fmt(e.first, e.second); })
+    | std::ranges::to<std::vector<std::string>>();
+} // args() }}}
+
+// args() {{{
+// Arguments of mkdwarfs for the compression configured in the environment
+inline std::vector<std::string> args(ns_config::FlatimageConfig const& config)
+{
+  return args(profile(config.layer_compression_preset
+    , config.opt_layer_compression_level
+    , config.layer_compression_options
+  ));
+} // args() }}}
+
+} // namespace ns_cmd::ns_compression
+
+/* vim: set expandtab fdm=marker ts=2 sw=2 tw=100 et :*/
@@ -11,7 +11,6 @@
 #include "../../cpp/lib/reserved/notify.hpp"
 #include "../../cpp/lib/db/desktop.hpp"
 #include "../../cpp/lib/subprocess.hpp"
-#include "../../cpp/lib/image.hpp"
 #include "../../cpp/lib/env.hpp"
 #include "../../cpp/lib/linux.hpp"
 #include "../../cpp/macro.hpp"
@@ -246,6 +245,9 @@ void integrate_icons_svg(ns_db::ns_desktop::Desktop const& desktop, fs::path con
 // integrate_icons_png() {{{
 void integrate_icons_png(ns_db::ns_desktop::Desktop const& desktop, fs::path const& path_file_icon)
 {
+  // The image helper is extracted on demand, it is not required to boot
+  auto opt_path_file_image = ns_subprocess::search_path("fim_image");
+  ereturn_if(not opt_path_file_image, "Could not find 'fim_image'");
   for(auto&& size : arr_sizes)
   {
     // Path to mimetype icon
@@ -262,8 +264,15 @@ void integrate_icons_png(ns_db::ns_desktop::Desktop const& desktop, fs::path con
     // Avoid overwrite
     if ( not fs::exists(*path_icon_mimetype) )
     {
-      auto result = ns_image::resize(path_file_icon, *path_icon_mimetype, size, size, true);
-      econtinue_if(not result.has_value(), result.error())
+      auto ret = ns_subprocess::wait(*opt_path_file_image
+        , "resize"
+        , path_file_icon.string()
+        , path_icon_mimetype->string()
+        , size
+        , size
+        , "--preserve-aspect-ratio"
+      );
+      econtinue_if(not ret or *ret != 0, "Could not resize icon '{}'"_fmt(path_file_icon));
     } // if
     // Duplicate icon to app directory
     if (std::error_code e; (fs::copy_file(*path_icon_mimetype, *path_icon_app, fs::copy_options::skip_existing, e), e) )
@@ -0,0 +1,212 @@
+///
+// @author      : Ruan E. Formigoni (ruanformigoni@gmail.com)
+// @file        : dwarfs
+///
+
+#pragma once
+
+#include <map>
+#include <array>
+#include <filesystem>
+#include <nlohmann/json.hpp>
+
+#include "../../cpp/lib/reserved/dwarfs.hpp"
+#include "../../cpp/lib/log.hpp"
+#include "../../cpp/std/enum.hpp"
+#include "../../cpp/std/vector.hpp"
+#include "../../cpp/std/exception.hpp"
+#include "../../cpp/macro.hpp"
+#include "../config/config.hpp"
+
+// Mount profiles of the dwarfs daemons, a global profile applies to every layer and a layer profile
+// overrides it for a single layer. They are stored in the reserved space, so they are available
+// before the layers are mounted.
+namespace ns_cmd::ns_dwarfs
+{
+
+ENUM(CmdDwarfsOp,PRESET,SET,CLEAR,LIST);
+
+struct CmdDwarfs
+{
+  CmdDwarfsOp op;
+  std::string value;
+  std::optional<uint64_t> opt_index_layer;
+};
+
+namespace
+{
+
+namespace fs = std::filesystem;
+
+using json_t = nlohmann::json;
+using profile_t = std::map<std::string,std::string>;
+
+// Options of the dwarfs daemon that can be set in a profile
+constexpr std::array<std::string_view,9> const OPTIONS_VALUE
+{
+  "workers", "readahead", "blocksize", "cachesize", "decratio", "mlock", "tidy_strategy", "tidy_interval", "tidy_max_age"
+};
+constexpr std::array<std::string_view,5> const OPTIONS_FLAG
+{
+  "preload_all", "cache_image", "no_cache_image", "cache_files", "no_cache_files"
+};
+
+// Presets, measure them on an image with doc/bench-dwarfs-profiles.sh
+// latency    : Interactive programs, more workers to decompress blocks in parallel, keeps the cache
+//              in memory and never evicts it
+// throughput : Batch tools that read large files sequentially, aggressive readahead
+// low-memory : Thin clients, a single worker, evicts unused blocks and skips the kernel page cache
+//              of the image, which duplicates the block cache
+inline std::map<std::string,profile_t> const PRESETS
+{
+    { "latency", {{"workers", "4"}, {"readahead", "1m"}, {"mlock", "try"}, {"tidy_strategy", "none"}} }
+  , { "throughput", {{"workers", "2"}, {"readahead", "32m"}, {"tidy_strategy", "none"}} }
+  , { "low-memory", {{"workers", "1"}, {"readahead", "0"}, {"tidy_strategy", "time"}, {"tidy_interval", "30s"}, {"tidy_max_age", "2m"}, {"no_cache_image", ""}} }
+};
+
+// write_json() {{{
+inline void write_json(ns_config::FlatimageConfig const& config, json_t const& json)
+{
+  auto error = ns_reserved::ns_dwarfs::write(config.path_file_binary
+    , config.offset_dwarfs.offset
+    , config.offset_dwarfs.size
+    , json.dump()
+  );
+  ethrow_if(error, "Could not write dwarfs profiles: {}"_fmt(*error));
+} // write_json() }}}
+
+// scope() {{{
+// Object of the global profile or of a layer profile in the json
+inline json_t& scope(json_t& json, std::optional<uint64_t> opt_index_layer)
+{
+  return opt_index_layer? json["layers"][std::to_string(*opt_index_layer)] : json["global"];
+} // scope() }}}
+
+// profile() {{{
+inline profile_t profile(json_t const& json, std::optional<uint64_t> opt_index_layer)
+{
+  return ns_exception::or_default([&]
+  {
+    json_t json_scope = opt_index_layer?
+        json.value("layers", json_t::object()).value(std::to_string(*opt_index_layer), json_t::object())
+      : json.value("global", json_t::object());
+    return json_scope.get<profile_t>();
+  });
+} // profile() }}}
+
+// parse() {{{
+// Parses a comma separated list of key=value pairs and flags
+inline profile_t parse(std::string_view str_options)
+{
+  profile_t profile;
+  for(auto&& option : ns_vector::from_string(str_options, ','))
+  {
+    auto pos = option.find('=');
+    std::string key = option.substr(0, pos);
+    std::string value = (pos == std::string::npos)? "" : option.substr(pos+1);
+    bool is_value = std::ranges::contains(OPTIONS_VALUE, key);
+    bool is_flag = std::ranges::contains(OPTIONS_FLAG, key);
+    ethrow_if(not is_value and not is_flag, "Unsupported dwarfs option '{}'"_fmt(key));
+    ethrow_if(is_value and value.empty(), "Option '{}' requires a value"_fmt(key));
+    ethrow_if(is_flag and not value.empty(), "Option '{}' does not take a value"_fmt(key));
+    profile[key] = value;
+  } // for
+  return profile;
+} // parse() }}}
+
+} // namespace
+
+// options() {{{
+// Options of the daemon of a layer, the layer profile overrides the global one
+inline std::vector<std::string> options(json_t const& json, uint64_t index_layer)
+{
+  profile_t profile_layer = profile(json, std::nullopt);
+  for(auto&& [key, value] : profile(json, index_layer))
+  {
+    profile_layer[key] = value;
+  } // for
+  return profile_layer
+    | std::views::transform([](auto&& e){ return e.second.empty()? e.first : "{}={}"_fmt(e.first, e.second); })
+    | std::ranges::to<std::vector<std::string>>();
+} // options() }}}
+
+// read() {{{
+[[nodiscard]] inline json_t read(ns_config::FlatimageConfig const& config)
+{
+  auto expected_json = ns_reserved::ns_dwarfs::read(config.path_file_binary
+    , config.offset_dwarfs.offset
+    , config.offset_dwarfs.size
+  );
+  ereturn_if(not expected_json, "Could not read dwarfs profiles: {}"_fmt(expected_json.error()), json_t::object());
+  qreturn_if(expected_json->empty(), json_t::object());
+  json_t json = json_t::parse(*expected_json, nullptr, false);
+  ereturn_if(json.is_discarded() or not json.is_object(), "Invalid dwarfs profiles", json_t::object());
+  return json;
+} // read() }}}
+
+// set() {{{
+// Merges the options in the profile
+inline void set(ns_config::FlatimageConfig const& config, std::string_view str_options, std::optional<uint64_t> opt_index_layer)
+{
+  json_t json = read(config);
+  for(auto&& [key, value] : parse(str_options))
+  {
+    scope(json, opt_index_layer)[key] = value;
+  } // for
+  write_json(config, json);
+} // set() }}}
+
+// preset() {{{
+// Replaces the profile with a preset
+inline void preset(ns_config::FlatimageConfig const& config, std::string const& name, std::optional<uint64_t> opt_index_layer)
+{
+  auto it = PRESETS.find(name);
+  ethrow_if(it == PRESETS.end(), "Unknown dwarfs preset '{}'"_fmt(name));
+  json_t json = read(config);
+  scope(json, opt_index_layer) = it->second;
+  write_json(config, json);
+} // preset() }}}
+
+// clear() {{{
+inline void clear(ns_config::FlatimageConfig const& config, std::optional<uint64_t> opt_index_layer)
+{
+  json_t json = read(config);
+  if ( opt_index_layer and json.contains("layers") )
+  {
+    json["layers"].erase(std::to_string(*opt_index_layer));
+  } // if
+  else if ( not opt_index_layer )
+  {
+    json.erase("global");
+  } // else if
+  write_json(config, json);
+} // clear() }}}
+
+// squash() {{{
+// Re-indexes the layer profiles after the layers [first,last] are merged into the layer first,
+// the profiles of the merged layers are dropped
+inline void squash(ns_config::FlatimageConfig const& config, uint64_t first, uint64_t last)
+{
+  json_t json = read(config);
+  qreturn_if(not json.contains("layers"));
+  json_t json_layers = json_t::object();
+  for(auto&& [key, value] : json["layers"].items())
+  {
+    auto expected_index = ns_exception::to_expected([&]{ return std::stoull(key); });
+    qcontinue_if(not expected_index);
+    if ( *expected_index < first ) { json_layers[key] = value; }
+    else if ( *expected_index > last ) { json_layers[std::to_string(*expected_index - (last - first))] = value; }
+  } // for
+  json["layers"] = json_layers;
+  write_json(config, json);
+} // squash() }}}
+
+// list() {{{
+inline void list(ns_config::FlatimageConfig const& config)
+{
+  println(read(config).dump(2));
+} // list() }}}
+
+} // namespace ns_cmd::ns_dwarfs
+
+/* vim: set expandtab fdm=marker ts=2 sw=2 tw=100 et :*/
@@ -75,7 +75,7 @@ inline std::string help_usage()
     .with_args({
       { "cmd", "Name of the command to display help details" },
     })
-    .with_note("Available commands: fim-{exec,root,perms,env,desktop,layer,bind,commit,boot}")
+    .with_note("Available commands: fim-{exec,root,perms,env,desktop,layer,bind,commit,dwarfs,bench,boot}")
     .with_example(R"(fim-help bind")")
     .get();
 }
@@ -172,16 +172,34 @@ inline std::string layer_usage()
     .with_commands({
       { "create", "Creates a novel layer from <in-dir> and save in <out-file>" },
       { "add", "Includes the novel layer <in-file> in the image in the top of the layer stack" },
+      { "list", "Lists the layers of the image from the bottom to the top of the stack" },
+      { "squash", "Merges the layers [first,last] into a single layer, all layers by default" },
+      { "probe", "Compares the compression presets on a sample of <in-dir>" },
     })
-    .with_usage("fim-layer create <in-dir> <out-file>")
+    .with_usage("fim-layer create <in-dir> <out-file> [order-file]")
     .with_args({
       { "in-dir", "Input directory to create a novel layer from"},
       { "out-file" , "Output file name of the layer file"},
+      { "order-file" , "Files relative to <in-dir>, one per line, laid out first and in this order"},
     })
     .with_usage("fim-layer add <in-file>")
     .with_args({
       { "in-file", "Path to the layer file to include in the FlatImage"},
     })
+    .with_usage("fim-layer list")
+    .with_usage("fim-layer squash [first] [last]")
+    .with_args({
+      { "first", "Index of the bottom layer to merge, defaults to 0"},
+      { "last", "Index of the top layer to merge, defaults to the top of the stack"},
+    })
+    .with_usage("fim-layer probe <in-dir> [presets...]")
+    .with_args({
+      { "in-dir", "Input directory to sample, up to FIM_COMPRESSION_SAMPLE MiB (default 256)"},
+      { "presets...", "Compression presets to compare, defaults to all of them"},
+    })
+    .with_note("The compression of create, squash and fim-commit is set with FIM_COMPRESSION_PRESET,"
+      " one of fast-start, balanced (default) or smallest. FIM_COMPRESSION_LEVEL (0-9) and"
+      " FIM_COMPRESSION_OPTIONS override it, e.g., FIM_COMPRESSION_OPTIONS=num-workers=4,block-size-bits=22")
     .get();
 }
 
@@ -216,6 +234,8 @@ inline std::string commit_usage()
       { "commit", "Compress and include changes in the image" },
     })
     .with_usage("fim-commit")
+    .with_note("Files are laid out in the access order recorded by launches with FIM_PREFETCH_RECORD=1,"
+      " files identical to the ones in the image are left out of the layer")
     .get();
 }
 
@@ -241,6 +261,52 @@ inline std::string casefold_usage()
     .get();
 }
 
+inline std::string dwarfs_usage()
+{
+  return HelpEntry{"fim-dwarfs"}
+    .with_description("Configure how the compressed layers are mounted")
+    .with_commands({
+      { "preset", "Replace the profile with a preset" },
+      { "set", "Set options of the dwarfs daemon in the profile" },
+      { "clear", "Erase the profile" },
+      { "list", "List the profiles" },
+    })
+    .with_usage("fim-dwarfs preset <name> [layer]")
+    .with_args({
+      { "name", "latency, throughput, low-memory" },
+      { "layer", "Index of the layer, the global profile is used if omitted" },
+    })
+    .with_usage("fim-dwarfs set <options> [layer]")
+    .with_args({
+      { "options", "Comma separated options, workers, readahead, blocksize, cachesize, decratio, mlock,"
+        " tidy_strategy, tidy_interval, tidy_max_age, preload_all, cache_image, no_cache_image,"
+        " cache_files, no_cache_files" },
+      { "layer", "Index of the layer, the global profile is used if omitted" },
+    })
+    .with_usage("fim-dwarfs clear [layer]")
+    .with_usage("fim-dwarfs list")
+    .with_example("fim-dwarfs set workers=4,mlock=try 0")
+    .with_note("The options of a layer override the global ones")
+    .get();
+}
+
+inline std::string bench_usage()
+{
+  return HelpEntry{"fim-bench"}
+    .with_description("Measure the parallel read throughput of the compressed layers")
+    .with_commands({
+      { "bench", "Read every file of the layers once and report the throughput" },
+    })
+    .with_usage("fim-bench [threads]")
+    .with_args({
+      { "threads", "Number of parallel readers, defaults to the number of cores" },
+    })
+    .with_example("FIM_FUSE_TUNING_DWARFS=128:96 fim-bench 16")
+    .with_note("The fuse connections are tuned with FIM_FUSE_TUNING_<BACKEND>=<max_background>:<congestion_threshold>,"
+      " which usually requires root")
+    .get();
+}
+
 inline std::string boot_usage()
 {
   return HelpEntry{"fim-boot"}
@@ -5,10 +5,30 @@
 
 #pragma once
 
+#include <set>
+#include <map>
 #include <cmath>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <cstring>
+#include <fstream>
 #include <filesystem>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <sys/sysmacros.h>
 
 #include "../../cpp/lib/subprocess.hpp"
+#include "../../cpp/lib/dwarfs.hpp"
+#include "../../cpp/lib/reserved/layers.hpp"
+#include "../../cpp/lib/fuse.hpp"
+#include "../../cpp/lib/linux.hpp"
+#include "../config/config.hpp"
+#include "dwarfs.hpp"
+#include "bench.hpp"
+#include "compression.hpp"
 
 namespace
 {
@@ -20,26 +40,537 @@ namespace fs = std::filesystem;
 namespace ns_layers
 {
 
+using Layer = ns_reserved::ns_layers::Layer;
+
+namespace
+{
+
+constexpr uint64_t const FNV_OFFSET = 14695981039346656037ull;
+constexpr uint64_t const FNV_PRIME = 1099511628211ull;
+
+// fn: hash_update() {{{
+// 64-bit FNV-1a
+inline uint64_t hash_update(uint64_t hash, char const* data, size_t size)
+{
+  for(size_t i = 0; i < size; ++i)
+  {
+    hash = (hash ^ static_cast<uint8_t>(data[i])) * FNV_PRIME;
+  } // for
+  return hash;
+} // fn: hash_update() }}}
+
+// fn: hash() {{{
+inline uint64_t hash(fs::path const& path_file, uint64_t offset, uint64_t size)
+{
+  std::ifstream file(path_file, std::ios::binary);
+  file.seekg(offset);
+  uint64_t value = FNV_OFFSET;
+  std::vector<char> buffer(1 << 20);
+  while ( size > 0 and file.read(buffer.data(), std::min<uint64_t>(size, buffer.size())) )
+  {
+    value = hash_update(value, buffer.data(), file.gcount());
+    size -= file.gcount();
+  } // while
+  return value;
+} // fn: hash() }}}
+
+// fn: format() {{{
+inline std::array<char,8> format(std::string_view name)
+{
+  std::array<char,8> format{};
+  std::ranges::copy(name.substr(0, format.size()), format.begin());
+  return format;
+} // fn: format() }}}
+
+// fn: scan() {{{
+// Finds the layers by seeking through their size prefixes, for images without a layer table
+inline std::vector<Layer> scan(fs::path const& path_file_binary, uint64_t offset)
+{
+  std::vector<Layer> vec_layers;
+  uint64_t size_file = fs::file_size(path_file_binary);
+  std::ifstream file_binary(path_file_binary, std::ios::binary);
+  file_binary.seekg(offset);
+  int64_t size_fs;
+  while ( file_binary.read(reinterpret_cast<char*>(&size_fs), sizeof(size_fs)) )
+  {
+    offset += sizeof(size_fs);
+    // The size prefix is written last, interrupted appends leave it zeroed
+    ebreak_if(size_fs <= 0 or offset + size_fs > size_file, "Incomplete layer at the end of the image");
+    ebreak_if(not ns_dwarfs::is_dwarfs(path_file_binary, offset), "Invalid dwarfs filesystem appended on the image");
+    vec_layers.push_back(Layer{ .offset = offset, .size = uint64_t(size_fs), .format = format("dwarfs"), .hash = 0, .time_created = 0, .hash_parent = 0 });
+    offset += size_fs;
+    file_binary.seekg(offset);
+  } // while
+  return vec_layers;
+} // fn: scan() }}}
+
+// fn: mount() {{{
+// Mounts the layers [first,last] of the image read-only, they are un-mounted on destruction
+inline std::vector<std::unique_ptr<ns_dwarfs::Dwarfs>> mount(ns_config::FlatimageConfig const& config
+  , std::vector<Layer> const& vec_layers
+  , uint64_t first
+  , uint64_t last
+  , fs::path const& path_dir_mount)
+{
+  auto time_begin = std::chrono::steady_clock::now();
+  std::vector<std::unique_ptr<ns_dwarfs::Dwarfs>> vec_mounts;
+  std::vector<std::pair<fs::path,std::optional<pid_t>>> vec_mount_pending;
+  for(uint64_t i = first; i <= last and i < vec_layers.size(); ++i)
+  {
+    fs::path path_dir_mount_index = path_dir_mount / std::to_string(i);
+    fs::create_directories(path_dir_mount_index);
+    vec_mounts.push_back(std::make_unique<ns_dwarfs::Dwarfs>(config.path_file_binary
+      , path_dir_mount_index
+      , vec_layers[i].offset
+      , vec_layers[i].size
+      , uint64_t{256} << 20
+      , std::vector<std::string>{}
+      , getpid()
+    ));
+    vec_mount_pending.emplace_back(path_dir_mount_index, vec_mounts.back()->get_pid());
+  } // for
+  ethrow_if(not ns_fuse::wait_fuse(vec_mount_pending).empty(), "Could not mount the layers of the image");
+  ns_log::info()("Mounted {} layers in {}ms"
+    , vec_mounts.size()
+    , std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - time_begin).count()
+  );
+  return vec_mounts;
+} // fn: mount() }}}
+
+// fn: copy_attributes() {{{
+// Applies the owner, mode and timestamps of st to path, the owner only where it is permitted. The
+// mode is set after the owner, which clears the set-user-id bits.
+inline void copy_attributes(fs::path const& path, struct stat const& st)
+{
+  std::ignore = lchown(path.c_str(), st.st_uid, st.st_gid);
+  if ( not S_ISLNK(st.st_mode) ) { std::ignore = chmod(path.c_str(), st.st_mode & 07777); }
+  struct timespec const times[2] = { st.st_atim, st.st_mtim };
+  elog_if(utimensat(AT_FDCWD, path.c_str(), times, AT_SYMLINK_NOFOLLOW) < 0
+    , "Could not set the timestamps of '{}': {}"_fmt(path, strerror(errno))
+  );
+} // fn: copy_attributes() }}}
+
+// fn: set_attributes() {{{
+// From the deepest directory up, so a read-only parent does not block its children and the
+// timestamps of a parent are set after its children are modified
+inline void set_attributes(std::map<fs::path,struct stat> const& map_attributes)
+{
+  for(auto&& [path_dir, st] : map_attributes | std::views::reverse)
+  {
+    copy_attributes(path_dir, st);
+  } // for
+} // fn: set_attributes() }}}
+
+// fn: is_whiteout() {{{
+inline bool is_whiteout(struct stat const& st)
+{
+  return S_ISCHR(st.st_mode) and st.st_rdev == makedev(0, 0);
+} // fn: is_whiteout() }}}
+
+// fn: is_opaque() {{{
+// Directories of an overlay layer that hide the contents of the layers below
+inline bool is_opaque(fs::path const& path_dir)
+{
+  char value;
+  auto f_xattr = [&](char const* name){ return getxattr(path_dir.c_str(), name, &value, 1) == 1 and value == 'y'; };
+  return fs::exists(path_dir / ".wh..wh..opq") or f_xattr("trusted.overlay.opaque") or f_xattr("user.overlay.opaque");
+} // fn: is_opaque() }}}
+
+// fn: lookup() {{{
+// Entry of the merged view of the lower layers at path_rel, the layers go from the top to the
+// bottom. Whiteouts and opaque directories hide the entries of the layers below them.
+inline std::optional<fs::path> lookup(std::vector<fs::path> const& vec_path_dir_lower
+  , fs::path const& path_rel
+  , std::map<fs::path,bool>& map_opaque)
+{
+  auto f_is_opaque = [&](fs::path const& path_dir)
+  {
+    auto it = map_opaque.find(path_dir);
+    if ( it == map_opaque.end() ) { it = map_opaque.emplace(path_dir, is_opaque(path_dir)).first; }
+    return it->second;
+  };
+  for(auto&& path_dir_lower : vec_path_dir_lower)
+  {
+    fs::path path_lower = path_dir_lower / path_rel;
+    struct stat st;
+    if ( lstat(path_lower.c_str(), &st) == 0 )
+    {
+      return is_whiteout(st)? std::nullopt : std::make_optional(path_lower);
+    } // if
+    qreturn_if(fs::exists(fs::symlink_status(path_lower.parent_path() / (".wh." + path_rel.filename().string()))), std::nullopt);
+    // An opaque ancestor in this layer hides the layers below
+    for(fs::path path_parent = path_rel.parent_path(); not path_parent.empty(); path_parent = path_parent.parent_path())
+    {
+      qreturn_if(f_is_opaque(path_dir_lower / path_parent), std::nullopt);
+    } // for
+  } // for
+  return std::nullopt;
+} // fn: lookup() }}}
+
+// fn: entries() {{{
+// Names in the directory path_rel of the merged view of the lower layers, the layers go from the
+// top to the bottom until one of them hides the ones below
+inline std::set<std::string> entries(std::vector<fs::path> const& vec_path_dir_lower
+  , fs::path const& path_rel
+  , std::map<fs::path,bool>& map_opaque)
+{
+  std::set<std::string> set_visible, set_hidden;
+  for(auto&& path_dir_lower : vec_path_dir_lower)
+  {
+    fs::path path_dir = path_dir_lower / path_rel;
+    struct stat st;
+    if ( lstat(path_dir.c_str(), &st) < 0 )
+    {
+      // Same rules as lookup, a missing directory only hides the layers below through its parents
+      qbreak_if(fs::exists(fs::symlink_status(path_dir.parent_path() / (".wh." + path_rel.filename().string()))));
+      bool is_hidden = false;
+      for(fs::path path_parent = path_rel.parent_path(); not path_parent.empty() and not is_hidden; path_parent = path_parent.parent_path())
+      {
+        fs::path path_dir_parent = path_dir_lower / path_parent;
+        auto it = map_opaque.find(path_dir_parent);
+        if ( it == map_opaque.end() ) { it = map_opaque.emplace(path_dir_parent, is_opaque(path_dir_parent)).first; }
+        is_hidden = it->second;
+      } // for
+      qbreak_if(is_hidden);
+      continue;
+    } // if
+    qbreak_if(not S_ISDIR(st.st_mode));
+    std::error_code ec;
+    for(auto&& entry : fs::directory_iterator(path_dir, ec))
+    {
+      std::string name = entry.path().filename().string();
+      qcontinue_if(name == ".wh..wh..opq");
+      struct stat st_entry;
+      qcontinue_if(lstat(entry.path().c_str(), &st_entry) < 0);
+      std::string name_target = name.starts_with(".wh.")? name.substr(4) : name;
+      qcontinue_if(set_visible.contains(name_target) or set_hidden.contains(name_target));
+      if ( is_whiteout(st_entry) or name.starts_with(".wh.") ) { set_hidden.insert(name_target); }
+      else { set_visible.insert(name_target); }
+    } // for
+    qbreak_if(is_opaque(path_dir));
+  } // for
+  return set_visible;
+} // fn: entries() }}}
+
+// fn: merge() {{{
+// Copies a layer on top of the merged tree, whiteouts remove the entries they hide. Whiteouts are
+// kept as character devices 0/0 when there are layers below the merged ones, vec_path_dir_lower from
+// the top to the bottom, and the opaque directories get a whiteout for each entry of those layers.
+// Files are copied by a pool of threads and keep their owner, mode and timestamps. The attributes
+// of the directories are returned to be applied once all layers are merged, so read-only
+// directories can still be written.
+inline void merge(fs::path const& path_dir_layer
+  , fs::path const& path_dir_dst
+  , std::vector<fs::path> const& vec_path_dir_lower
+  , std::map<fs::path,struct stat>& map_attributes)
+{
+  std::error_code ec;
+  bool is_keep_whiteouts = not vec_path_dir_lower.empty();
+  std::map<fs::path,bool> map_opaque;
+  std::vector<std::tuple<fs::path,fs::path,struct stat>> vec_files;
+  auto f_clear = [&](fs::path const& path_dst)
+  {
+    if ( fs::is_directory(fs::symlink_status(path_dst)) ) { fs::remove_all(path_dst, ec); }
+    else { fs::remove(path_dst, ec); }
+  };
+  for(auto it = fs::recursive_directory_iterator(path_dir_layer, fs::directory_options::skip_permission_denied, ec)
+    ; it != fs::recursive_directory_iterator()
+    ; it.increment(ec))
+  {
+    fs::path path_src = it->path();
+    fs::path path_rel = path_src.lexically_relative(path_dir_layer);
+    fs::path path_dst = path_dir_dst / path_rel;
+    std::string name = path_src.filename().string();
+    struct stat st;
+    econtinue_if(lstat(path_src.c_str(), &st) < 0, "Could not stat '{}': {}"_fmt(path_src, strerror(errno)));
+    // The marker of opaque directories is handled with its directory
+    qcontinue_if(name == ".wh..wh..opq");
+    // Whiteouts are character devices 0/0 or files prefixed with '.wh.'
+    bool is_whiteout_dev = is_whiteout(st);
+    if ( is_whiteout_dev or name.starts_with(".wh.") )
+    {
+      fs::path path_hidden = is_whiteout_dev? path_dst : path_dst.parent_path() / name.substr(4);
+      f_clear(path_hidden);
+      // Without the whiteout the layers below the range would show the deleted entry again
+      ethrow_if(is_keep_whiteouts and mknod(path_hidden.c_str(), S_IFCHR, makedev(0, 0)) < 0
+        , "Could not keep whiteout '{}': {}"_fmt(path_hidden, strerror(errno))
+      );
+      continue;
+    } // if
+    if ( S_ISDIR(st.st_mode) )
+    {
+      bool is_opaque_src = is_opaque(path_src);
+      if ( is_opaque_src or not fs::is_directory(fs::symlink_status(path_dst)) ) { f_clear(path_dst); }
+      fs::create_directories(path_dst, ec);
+      econtinue_if(ec, "Could not create directory '{}': {}"_fmt(path_dst, ec.message()));
+      map_attributes[path_dst] = st;
+      qcontinue_if(not is_opaque_src or not is_keep_whiteouts);
+      // Same as stage, the marker is not understood by every overlay backend
+      for(auto&& name_lower : entries(vec_path_dir_lower, path_rel, map_opaque))
+      {
+        qcontinue_if(fs::exists(fs::symlink_status(path_src / name_lower)));
+        ethrow_if(mknod((path_dst / name_lower).c_str(), S_IFCHR, makedev(0, 0)) < 0
+          , "Could not keep whiteout '{}': {}"_fmt(path_dst / name_lower, strerror(errno))
+        );
+      } // for
+      continue;
+    } // if
+    f_clear(path_dst);
+    if ( S_ISLNK(st.st_mode) )
+    {
+      fs::copy_symlink(path_src, path_dst, ec);
+      econtinue_if(ec, "Could not copy symlink '{}': {}"_fmt(path_src, ec.message()));
+      copy_attributes(path_dst, st);
+    } // if
+    else if ( S_ISREG(st.st_mode) )
+    {
+      vec_files.emplace_back(path_src, path_dst, st);
+    } // else if
+    else
+    {
+      ns_log::error()("Skip special file '{}'", path_src);
+    } // else
+  } // for
+  // Copy the files in parallel
+  std::atomic<size_t> index{0};
+  std::atomic<size_t> count_errors{0};
+  {
+    std::vector<std::jthread> vec_threads;
+    for(size_t t = 0; t < std::max(std::thread::hardware_concurrency(), 1u); ++t)
+    {
+      vec_threads.emplace_back([&]
+      {
+        for(size_t i = index++; i < vec_files.size(); i = index++)
+        {
+          auto const& [path_src, path_dst, st] = vec_files[i];
+          std::error_code ec_copy;
+          fs::copy_file(path_src, path_dst, fs::copy_options::overwrite_existing, ec_copy);
+          if ( not ec_copy )
+          {
+            copy_attributes(path_dst, st);
+            continue;
+          } // if
+          ns_log::error()("Could not copy '{}': {}", path_src, ec_copy.message());
+          ++count_errors;
+        } // for
+      });
+    } // for
+  }
+  ethrow_if(count_errors > 0, "Failed to copy {} files from '{}'"_fmt(count_errors.load(), path_dir_layer));
+} // fn: merge() }}}
+
+// fn: is_equal_content() {{{
+inline bool is_equal_content(fs::path const& path_file_a, fs::path const& path_file_b)
+{
+  std::ifstream file_a(path_file_a, std::ios::binary);
+  std::ifstream file_b(path_file_b, std::ios::binary);
+  qreturn_if(not file_a.is_open() or not file_b.is_open(), false);
+  std::vector<char> buffer_a(1 << 20), buffer_b(1 << 20);
+  while ( true )
+  {
+    file_a.read(buffer_a.data(), buffer_a.size());
+    file_b.read(buffer_b.data(), buffer_b.size());
+    qreturn_if(file_a.gcount() != file_b.gcount(), false);
+    qreturn_if(file_a.gcount() == 0, true);
+    qreturn_if(not std::equal(buffer_a.begin(), buffer_a.begin() + file_a.gcount(), buffer_b.begin()), false);
+  } // while
+} // fn: is_equal_content() }}}
+
+// fn: is_unchanged() {{{
+// Checks if an upper entry is a copy of the lower one, by size and mode, then by modification time,
+// then by content. Ownership is not compared, the sandbox maps it to the user.
+inline bool is_unchanged(fs::path const& path_upper, struct stat const& st_upper, fs::path const& path_lower)
+{
+  struct stat st_lower;
+  qreturn_if(lstat(path_lower.c_str(), &st_lower) < 0, false);
+  qreturn_if(st_upper.st_mode != st_lower.st_mode or st_upper.st_size != st_lower.st_size, false);
+  if ( S_ISLNK(st_upper.st_mode) )
+  {
+    std::error_code ec_upper, ec_lower;
+    return fs::read_symlink(path_upper, ec_upper) == fs::read_symlink(path_lower, ec_lower) and not ec_upper and not ec_lower;
+  } // if
+  qreturn_if(not S_ISREG(st_upper.st_mode), false);
+  qreturn_if(st_upper.st_mtim.tv_sec == st_lower.st_mtim.tv_sec and st_upper.st_mtim.tv_nsec == st_lower.st_mtim.tv_nsec, true);
+  return is_equal_content(path_upper, path_lower);
+} // fn: is_unchanged() }}}
+
+// fn: end() {{{
+// Offset past the last complete layer, data after it was left by an interrupted append
+inline uint64_t end(ns_config::FlatimageConfig const& config, std::vector<Layer> const& vec_layers)
+{
+  return vec_layers.empty()? config.offset_filesystem : vec_layers.back().offset + vec_layers.back().size;
+} // fn: end() }}}
+
+// fn: prepare() {{{
+// Opens the image to append a layer past the complete ones. Layers of images without a table are
+// hashed once, so the new layer can refer to its parent.
+inline int prepare(ns_config::FlatimageConfig const& config, std::vector<Layer>& vec_layers)
+{
+  for(auto&& layer : vec_layers | std::views::filter([](auto&& e){ return e.hash == 0; }))
+  {
+    layer.hash = hash(config.path_file_binary, layer.offset, layer.size);
+  } // for
+  for(size_t i = 1; i < vec_layers.size(); ++i)
+  {
+    vec_layers[i].hash_parent = vec_layers[i-1].hash;
+  } // for
+  // Only the tail of an interrupted append is dropped, a zeroed size prefix or a layer that runs
+  // past the end of the file. Other data could be a layer this version does not recognize.
+  uint64_t offset_end = end(config, vec_layers);
+  uint64_t size_file = fs::file_size(config.path_file_binary);
+  if ( size_file > offset_end )
+  {
+    std::ifstream file_binary(config.path_file_binary, std::ios::binary);
+    file_binary.seekg(offset_end);
+    uint64_t size_fs{};
+    ethrow_if(not file_binary.read(reinterpret_cast<char*>(&size_fs), sizeof(size_fs))
+      , "Unrecognized data at offset {} of the image"_fmt(offset_end)
+    );
+    ethrow_if(size_fs != 0 and offset_end + sizeof(size_fs) + size_fs <= size_file
+      , "Unrecognized layer at offset {} of the image, refusing to append after it"_fmt(offset_end)
+    );
+    ns_log::info()("Drop {} bytes left by an interrupted append", size_file - offset_end);
+  } // if
+  int fd = open(config.path_file_binary.c_str(), O_WRONLY | O_CLOEXEC);
+  ethrow_if(fd < 0, "Failed to open '{}': {}"_fmt(config.path_file_binary, strerror(errno)));
+  if ( ftruncate(fd, offset_end) < 0 or lseek(fd, offset_end + sizeof(uint64_t), SEEK_SET) < 0 )
+  {
+    int error = errno;
+    close(fd);
+    "Failed to prepare '{}' for the layer: {}"_throw(config.path_file_binary, strerror(error));
+  } // if
+  return fd;
+} // fn: prepare() }}}
+
+// fn: publish() {{{
+// Makes the layer written past the end of the stack part of the image. The data is synced before
+// its size prefix is written, so a crash leaves either the old stack or the new one.
+inline void publish(ns_config::FlatimageConfig const& config
+  , int fd
+  , std::vector<Layer>& vec_layers
+  , std::string_view name_format)
+{
+  uint64_t offset_prefix = end(config, vec_layers);
+  off_t offset_end = lseek(fd, 0, SEEK_CUR);
+  auto f_abort = [&](std::string const& msg)
+  {
+    std::ignore = ftruncate(fd, offset_prefix);
+    close(fd);
+    "{}"_throw(msg);
+  };
+  if ( offset_end < 0 ) { f_abort("Could not find the end of the layer: {}"_fmt(strerror(errno))); }
+  uint64_t size = offset_end - offset_prefix - sizeof(uint64_t);
+  if ( size == 0 ) { f_abort("The layer is empty"); }
+  if ( fdatasync(fd) < 0 ) { f_abort("Could not sync the layer: {}"_fmt(strerror(errno))); }
+  if ( pwrite(fd, &size, sizeof(size), offset_prefix) != sizeof(size) or fdatasync(fd) < 0 )
+  {
+    f_abort("Could not write the size of the layer: {}"_fmt(strerror(errno)));
+  } // if
+  close(fd);
+  // The data is in the page cache, hashing it does not hit the disk
+  vec_layers.push_back(Layer
+  {
+      .offset = offset_prefix + sizeof(uint64_t)
+    , .size = size
+    , .format = format(name_format)
+    , .hash = hash(config.path_file_binary, offset_prefix + sizeof(uint64_t), size)
+    , .time_created = uint64_t(std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count())
+    , .hash_parent = vec_layers.empty()? 0 : vec_layers.back().hash
+  });
+  ns_log::info()("Included layer of {} MiB at offset {}", size >> 20, offset_prefix);
+  // Record the layer, without a table the layers are still found by scanning the image
+  auto error = ns_reserved::ns_layers::write(config.path_file_binary
+    , config.offset_layers.offset
+    , config.offset_layers.size
+    , vec_layers
+  );
+  elog_if(error, "Could not update the layer table: {}"_fmt(*error));
+} // fn: publish() }}}
+
+} // namespace
+
+// fn: format_name() {{{
+inline std::string format_name(Layer const& layer)
+{
+  return std::string(layer.format.data(), strnlen(layer.format.data(), layer.format.size()));
+} // fn: format_name() }}}
+
+// fn: stack() {{{
+// Layers appended to the image from the bottom to the top. The table is used if it matches the
+// layout of the image, layers appended by older versions invalidate it and the image is scanned.
+inline std::vector<Layer> stack(ns_config::FlatimageConfig const& config)
+{
+  auto expected_layers = ns_reserved::ns_layers::read(config.path_file_binary
+    , config.offset_layers.offset
+    , config.offset_layers.size
+  );
+  auto f_is_valid = [&](std::vector<Layer> const& vec_layers)
+  {
+    uint64_t offset = config.offset_filesystem;
+    for(auto&& layer : vec_layers)
+    {
+      qreturn_if(layer.offset != offset + sizeof(uint64_t), false);
+      offset = layer.offset + layer.size;
+    } // for
+    return offset == fs::file_size(config.path_file_binary);
+  };
+  qreturn_if(expected_layers and f_is_valid(*expected_layers), *expected_layers);
+  ns_log::debug()("Scan layers: {}", expected_layers? "Layer table is outdated" : expected_layers.error());
+  return scan(config.path_file_binary, config.offset_filesystem);
+} // fn: stack() }}}
+
+// fn: order() {{{
+// Writes the files of path_dir_src in the order they appear in the access traces, traces are the
+// lists recorded with FIM_PREFETCH_RECORD=1, one path relative to the root of the layer per line.
+// Returns false if no file of the traces is in path_dir_src.
+inline bool order(std::vector<fs::path> const& vec_path_file_trace
+  , fs::path const& path_dir_src
+  , fs::path const& path_file_order)
+{
+  std::set<fs::path> set_seen;
+  std::ofstream file_order(path_file_order, std::ios::trunc);
+  ethrow_if(not file_order.is_open(), "Could not open order file '{}'"_fmt(path_file_order));
+  for(fs::path const& path_file_trace : vec_path_file_trace)
+  {
+    std::ifstream file_trace(path_file_trace);
+    econtinue_if(not file_trace.is_open(), "Could not open trace file '{}'"_fmt(path_file_trace));
+    std::string line;
+    while ( std::getline(file_trace, line) )
+    {
+      fs::path path_file = fs::path{line}.relative_path();
+      qcontinue_if(path_file.empty() or set_seen.contains(path_file));
+      qcontinue_if(not fs::is_regular_file(fs::symlink_status(path_dir_src / path_file)));
+      set_seen.insert(path_file);
+      file_order << path_file.string() << '\n';
+    } // while
+  } // for
+  ns_log::info()("Ordered {} files by the access traces", set_seen.size());
+  return not set_seen.empty();
+} // fn: order() }}}
+
 // fn: create() {{{
-inline void create(fs::path const& path_dir_src, fs::path const& path_file_dst, uint64_t compression_level)
+// Files in path_file_order are laid out first and in that order, so the files a program reads at
+// startup share compressed blocks
+inline void create(fs::path const& path_dir_src
+  , fs::path const& path_file_dst
+  , std::vector<std::string> const& vec_compression_args
+  , std::optional<fs::path> const& opt_path_file_order = std::nullopt)
 {
   // Find mkdwarfs binary
   auto opt_path_file_mkdwarfs = ns_subprocess::search_path("mkdwarfs");
   ethrow_if(not opt_path_file_mkdwarfs, "Could not find 'mkdwarfs' binary");
 
-  // Compression level must be at least 1 and less or equal to 10
-  compression_level = std::clamp(compression_level, uint64_t{0}, uint64_t{9});
-
-  // // Convert to non-percentual compression level
-  // compression_level = std::ceil(22 * (static_cast<double>(compression_level) / 10));
-
   // Compress filesystem
-  ns_log::info()("Compression level: '{}'", compression_level);
+  ns_log::info()("Compression: '{}'", vec_compression_args);
   ns_log::info()("Compress filesystem to '{}'", path_file_dst);
   auto ret = ns_subprocess::Subprocess(*opt_path_file_mkdwarfs)
     .with_args("-f")
     .with_args("-i", path_dir_src, "-o", path_file_dst)
-    .with_args("-l", compression_level)
+    .with_args(vec_compression_args)
+    .with_args(opt_path_file_order?
+        std::vector<std::string>{"--order=explicit:file={}"_fmt(*opt_path_file_order)}
+      : std::vector<std::string>{}
+    )
     .spawn()
     .wait();
   ethrow_if(not ret, "mkdwarfs process exited abnormally");
@@ -47,26 +578,372 @@ inline void create(fs::path const& path_dir_src, fs::path const& path_file_dst,
 } // fn: create() }}}
 
 // fn: add() {{{
-inline void add(fs::path const& path_file_binary, fs::path const& path_file_layer)
-{
-  // Open binary file for writing
-  std::ofstream file_binary(path_file_binary, std::ios::app | std::ios::binary);
-  std::ifstream file_layer(path_file_layer, std::ios::in | std::ios::binary);
-  ereturn_if(not file_binary.is_open(), "Failed to open output file '{}'"_fmt(path_file_binary))
-  ereturn_if(not file_layer.is_open(), "Failed to open input file '{}'"_fmt(path_file_layer))
-  // Get byte size
-  uint64_t file_size = fs::file_size(path_file_layer);
-  // Write byte size
-  file_binary.write(reinterpret_cast<char*>(&file_size), sizeof(file_size));
-  char buff[8192];
-  while( file_layer.read(buff, sizeof(buff)) or file_layer.gcount() > 0 )
-  {
-    file_binary.write(buff, file_layer.gcount());
-    ereturn_if(not file_binary, "Error writing data to file");
-  } // while
+// Appends the layer to the image and records it in the layer table
+inline void add(ns_config::FlatimageConfig const& config, fs::path const& path_file_layer)
+{
+  int fd_layer = open(path_file_layer.c_str(), O_RDONLY | O_CLOEXEC);
+  ethrow_if(fd_layer < 0, "Failed to open input file '{}': {}"_fmt(path_file_layer, strerror(errno)));
+  std::vector<Layer> vec_layers = stack(config);
+  int fd = prepare(config, vec_layers);
+  // Copy in the kernel, fall back to a buffer across filesystems that do not support it
+  ssize_t count;
+  while ( (count = copy_file_range(fd_layer, nullptr, fd, nullptr, 1 << 30, 0)) > 0 );
+  if ( count < 0 and (errno == EXDEV or errno == EINVAL or errno == ENOSYS or errno == EOPNOTSUPP) )
+  {
+    std::vector<char> buffer(1 << 20);
+    while ( (count = ::read(fd_layer, buffer.data(), buffer.size())) > 0 )
+    {
+      qbreak_if(::write(fd, buffer.data(), count) != count);
+    } // while
+  } // if
+  int error = errno;
+  close(fd_layer);
+  if ( count != 0 )
+  {
+    std::ignore = ftruncate(fd, end(config, vec_layers));
+    close(fd);
+    "Could not copy layer '{}': {}"_throw(path_file_layer, strerror(error));
+  } // if
+  publish(config, fd, vec_layers, ns_dwarfs::is_dwarfs(path_file_layer)? "dwarfs" : "unknown");
   ns_log::info()("Included novel layer from file '{}'", path_file_layer);
 } // fn: add() }}}
 
+// fn: append() {{{
+// Compresses path_dir_src straight into the end of the image, without an intermediate file
+inline void append(ns_config::FlatimageConfig const& config
+  , fs::path const& path_dir_src
+  , std::vector<std::string> const& vec_compression_args
+  , std::optional<fs::path> const& opt_path_file_order = std::nullopt)
+{
+  auto opt_path_file_mkdwarfs = ns_subprocess::search_path("mkdwarfs");
+  ethrow_if(not opt_path_file_mkdwarfs, "Could not find 'mkdwarfs' binary");
+  std::vector<Layer> vec_layers = stack(config);
+  int fd = prepare(config, vec_layers);
+  ns_log::info()("Compression: '{}'", vec_compression_args);
+  ns_log::info()("Compress filesystem to '{}'", config.path_file_binary);
+  auto ret = ns_subprocess::Subprocess(*opt_path_file_mkdwarfs)
+    .with_args("-i", path_dir_src, "-o", "-")
+    .with_args(vec_compression_args)
+    .with_args(opt_path_file_order?
+        std::vector<std::string>{"--order=explicit:file={}"_fmt(*opt_path_file_order)}
+      : std::vector<std::string>{}
+    )
+    .with_stdout_fd(fd)
+    .spawn()
+    .wait();
+  if ( not ret or *ret != 0 )
+  {
+    std::ignore = ftruncate(fd, end(config, vec_layers));
+    close(fd);
+    ethrow_if(not ret, "mkdwarfs process exited abnormally");
+    "mkdwarfs process exited with error code '{}'"_throw(*ret);
+  } // if
+  publish(config, fd, vec_layers, "dwarfs");
+} // fn: append() }}}
+
+// fn: list() {{{
+// Prints the layer stack from the bottom to the top
+inline void list(ns_config::FlatimageConfig const& config)
+{
+  for(auto&& [index, layer] : stack(config) | std::views::enumerate)
+  {
+    auto f_hash = [](uint64_t hash){ return (hash == 0)? std::string{"-"} : "{:016x}"_fmt(hash); };
+    std::string str_time_created = (layer.time_created == 0)? std::string{"-"}
+      : "{:%F %T}"_fmt(std::chrono::sys_seconds{std::chrono::seconds{layer.time_created}});
+    println("{} offset={} size={} format={} hash={} created={} parent={}"
+      , index
+      , layer.offset
+      , layer.size
+      , format_name(layer)
+      , f_hash(layer.hash)
+      , str_time_created
+      , f_hash(layer.hash_parent)
+    );
+  } // for
+} // fn: list() }}}
+
+// fn: stage() {{{
+// Links the entries of path_dir_src that differ from the lower layers of the image into
+// path_dir_stage, so the layer only has the changes. Whiteouts and the contents of opaque
+// directories are always kept. Returns the number of bytes left out.
+inline uint64_t stage(ns_config::FlatimageConfig const& config, fs::path const& path_dir_src, fs::path const& path_dir_stage)
+{
+  fs::remove_all(path_dir_stage);
+  fs::create_directories(path_dir_stage);
+  std::vector<Layer> vec_layers = stack(config);
+  auto vec_mounts = mount(config, vec_layers, 0, vec_layers.size() - 1, config.path_dir_mount / "commit");
+  std::vector<fs::path> vec_path_dir_lower = vec_mounts
+    | std::views::reverse
+    | std::views::transform([](auto&& e){ return e->get_dir_mountpoint(); })
+    | std::ranges::to<std::vector<fs::path>>();
+  std::map<fs::path,bool> map_opaque;
+  std::map<fs::path,struct stat> map_attributes;
+  std::set<fs::path> set_opaque_upper;
+  uint64_t count_skipped{}, bytes_skipped{};
+  std::error_code ec;
+  for(auto it = fs::recursive_directory_iterator(path_dir_src, fs::directory_options::skip_permission_denied, ec)
+    ; it != fs::recursive_directory_iterator()
+    ; it.increment(ec))
+  {
+    fs::path path_src = it->path();
+    fs::path path_rel = path_src.lexically_relative(path_dir_src);
+    fs::path path_dst = path_dir_stage / path_rel;
+    struct stat st;
+    econtinue_if(lstat(path_src.c_str(), &st) < 0, "Could not stat '{}': {}"_fmt(path_src, strerror(errno)));
+    if ( S_ISDIR(st.st_mode) )
+    {
+      fs::create_directories(path_dst, ec);
+      econtinue_if(ec, "Could not create directory '{}': {}"_fmt(path_dst, ec.message()));
+      map_attributes[path_dst] = st;
+      qcontinue_if(not is_opaque(path_src));
+      set_opaque_upper.insert(path_rel);
+      // Opaque markers are not understood by every overlay backend, the lower entries that are
+      // not replaced get a whiteout each instead
+      for(auto&& name : entries(vec_path_dir_lower, path_rel, map_opaque))
+      {
+        qcontinue_if(fs::exists(fs::symlink_status(path_src / name)));
+        ethrow_if(mknod((path_dst / name).c_str(), S_IFCHR, makedev(0, 0)) < 0
+          , "Could not create whiteout '{}': {}"_fmt(path_dst / name, strerror(errno))
+        );
+      } // for
+      continue;
+    } // if
+    // The marker is replaced by the whiteouts of its directory
+    qcontinue_if(path_src.filename() == ".wh..wh..opq");
+    // The contents of an opaque directory replace the lower ones, so all of them are kept
+    bool is_in_opaque = std::ranges::any_of(set_opaque_upper, [&](auto&& e)
+    {
+      return std::ranges::mismatch(e, path_rel).in1 == e.end();
+    });
+    if ( not is_in_opaque and (S_ISREG(st.st_mode) or S_ISLNK(st.st_mode)) )
+    {
+      auto opt_path_lower = lookup(vec_path_dir_lower, path_rel, map_opaque);
+      if ( opt_path_lower and is_unchanged(path_src, st, *opt_path_lower) )
+      {
+        ns_log::debug()("Unchanged '{}'", path_rel);
+        count_skipped += 1;
+        bytes_skipped += st.st_size;
+        continue;
+      } // if
+    } // if
+    qcontinue_if(fs::exists(fs::symlink_status(path_dst)));
+    // Hard links are free on the same filesystem, copy otherwise
+    fs::create_hard_link(path_src, path_dst, ec);
+    if ( ec and is_whiteout(st) )
+    {
+      ec = (mknod(path_dst.c_str(), S_IFCHR, makedev(0, 0)) < 0)? std::error_code(errno, std::system_category()) : std::error_code{};
+    } // if
+    else if ( ec )
+    {
+      fs::copy(path_src, path_dst, fs::copy_options::copy_symlinks, ec);
+      if ( not ec ) { copy_attributes(path_dst, st); }
+    } // else if
+    elog_if(ec, "Could not stage '{}': {}"_fmt(path_src, ec.message()));
+  } // for
+  set_attributes(map_attributes);
+  ns_log::info()("Left out {} unchanged files ({} MiB)", count_skipped, bytes_skipped >> 20);
+  return bytes_skipped;
+} // fn: stage() }}}
+
+// fn: probe() {{{
+// Compresses a sample of path_dir_src with each preset, then reports the compression ratio and
+// the read throughput of the mounted sample
+inline void probe(ns_config::FlatimageConfig const& config, fs::path const& path_dir_src, std::vector<std::string> vec_presets)
+{
+  if ( vec_presets.empty() )
+  {
+    vec_presets = ns_cmd::ns_compression::PRESETS
+      | std::views::keys
+      | std::ranges::to<std::vector<std::string>>();
+  } // if
+  // Files of the input
+  std::error_code ec;
+  std::vector<std::pair<fs::path,uint64_t>> vec_files;
+  uint64_t size_total{};
+  for(auto&& entry : fs::recursive_directory_iterator(path_dir_src, fs::directory_options::skip_permission_denied, ec))
+  {
+    qcontinue_if(entry.is_symlink(ec) or not entry.is_regular_file(ec));
+    vec_files.emplace_back(entry.path(), entry.file_size(ec));
+    size_total += vec_files.back().second;
+  } // for
+  ethrow_if(vec_files.empty(), "No files to compress in '{}'"_fmt(path_dir_src));
+  // Sample files spread across the input, up to FIM_COMPRESSION_SAMPLE MiB
+  uint64_t size_sample_max = ns_exception::to_expected([]{ return std::stoull(ns_env::get_or_else("FIM_COMPRESSION_SAMPLE", "256")); })
+    .value_or(256) << 20;
+  double fraction = std::min(1.0, double(size_sample_max) / double(std::max<uint64_t>(size_total, 1)));
+  fs::path path_dir_probe = config.path_dir_host_config / "probe";
+  fs::path path_dir_sample = path_dir_probe / "sample";
+  fs::remove_all(path_dir_probe);
+  uint64_t size_sample{};
+  for(size_t i = 0; i < vec_files.size(); ++i)
+  {
+    qcontinue_if(std::floor((i+1) * fraction) == std::floor(i * fraction));
+    auto&& [path_file, size] = vec_files[i];
+    fs::path path_file_dst = path_dir_sample / path_file.lexically_relative(path_dir_src);
+    fs::create_directories(path_file_dst.parent_path(), ec);
+    fs::create_hard_link(path_file, path_file_dst, ec);
+    if ( ec ) { fs::copy_file(path_file, path_file_dst, ec); }
+    econtinue_if(ec, "Could not sample '{}': {}"_fmt(path_file, ec.message()));
+    size_sample += size;
+  } // for
+  ns_log::info()("Sampled {} of {} MiB", size_sample >> 20, size_total >> 20);
+  // Compress and read the sample with each preset
+  for(auto&& name_preset : vec_presets)
+  {
+    fs::path path_file_layer = path_dir_probe / "{}.layer"_fmt(name_preset);
+    auto time_begin = std::chrono::steady_clock::now();
+    create(path_dir_sample
+      , path_file_layer
+      , ns_cmd::ns_compression::args(ns_cmd::ns_compression::profile(name_preset, std::nullopt, ""))
+    );
+    auto ms_create = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - time_begin).count();
+    uint64_t size_layer = fs::file_size(path_file_layer);
+    fs::path path_dir_mount = config.path_dir_mount / "probe" / name_preset;
+    fs::create_directories(path_dir_mount);
+    uint64_t bytes{};
+    int64_t ms_read{};
+    {
+      ns_dwarfs::Dwarfs dwarfs(path_file_layer, path_dir_mount, 0, size_layer, uint64_t{256} << 20, {}, getpid());
+      std::vector<std::pair<fs::path,std::optional<pid_t>>> vec_mount{{path_dir_mount, dwarfs.get_pid()}};
+      ethrow_if(not ns_fuse::wait_fuse(vec_mount).empty(), "Could not mount '{}'"_fmt(path_file_layer));
+      std::vector<fs::path> vec_path_file;
+      for(auto&& entry : fs::recursive_directory_iterator(path_dir_mount, ec))
+      {
+        if ( not entry.is_symlink(ec) and entry.is_regular_file(ec) ) { vec_path_file.push_back(entry.path()); }
+      } // for
+      time_begin = std::chrono::steady_clock::now();
+      bytes = ns_cmd::ns_bench::read(vec_path_file, std::max(std::thread::hardware_concurrency(), 1u));
+      ms_read = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - time_begin).count();
+    }
+    println("{}: ratio {:.2f} ({} MiB to {} MiB) created in {}ms, read at {} MiB/s"
+      , name_preset
+      , double(size_sample) / double(std::max<uint64_t>(size_layer, 1))
+      , size_sample >> 20
+      , size_layer >> 20
+      , ms_create
+      , (bytes >> 20) * 1000 / std::max<int64_t>(ms_read, 1)
+    );
+  } // for
+  fs::remove_all(path_dir_probe, ec);
+} // fn: probe() }}}
+
+// fn: squash() {{{
+// Merges the layers [first,last] of the image into a single layer and replaces the image
+inline void squash(ns_config::FlatimageConfig const& config
+  , std::optional<uint64_t> opt_first
+  , std::optional<uint64_t> opt_last)
+{
+  std::vector<Layer> vec_layers = stack(config);
+  uint64_t first = opt_first.value_or(0);
+  uint64_t last = opt_last.value_or(vec_layers.empty()? 0 : vec_layers.size() - 1);
+  ethrow_if(first >= last or last >= vec_layers.size()
+    , "Invalid range of layers [{},{}], the image has {} layers"_fmt(first, last, vec_layers.size())
+  );
+  fs::path path_dir_squash = config.path_dir_host_config / "squash";
+  fs::path path_dir_root = path_dir_squash / "root";
+  fs::path path_file_layer = path_dir_squash / "layer";
+  fs::path path_dir_mount = config.path_dir_mount / "squash";
+  fs::path path_file_image = config.path_file_binary.string() + ".squash";
+  fs::remove_all(path_dir_squash);
+  fs::create_directories(path_dir_root);
+  // Merge the layers from the bottom to the top
+  {
+    // The layers below the range are kept, the whiteouts of the merged layer still hide their entries
+    std::vector<std::unique_ptr<ns_dwarfs::Dwarfs>> vec_mounts_lower;
+    if ( first > 0 ) { vec_mounts_lower = mount(config, vec_layers, 0, first - 1, path_dir_mount); }
+    std::vector<fs::path> vec_path_dir_lower = vec_mounts_lower
+      | std::views::reverse
+      | std::views::transform([](auto&& e){ return e->get_dir_mountpoint(); })
+      | std::ranges::to<std::vector<fs::path>>();
+    auto vec_mounts = mount(config, vec_layers, first, last, path_dir_mount);
+    std::map<fs::path,struct stat> map_attributes;
+    for(auto&& layer_mount : vec_mounts)
+    {
+      ns_log::info()("Merge layer '{}'", layer_mount->get_dir_mountpoint().filename());
+      merge(layer_mount->get_dir_mountpoint(), path_dir_root, vec_path_dir_lower, map_attributes);
+    } // for
+    set_attributes(map_attributes);
+  }
+  // Compress the merged tree
+  create(path_dir_root, path_file_layer, ns_cmd::ns_compression::args(config));
+  // Write the image to a temporary file, the layers below and above the range are kept as is
+  uint64_t offset_begin = vec_layers[first].offset - sizeof(uint64_t);
+  uint64_t offset_end = vec_layers[last].offset + vec_layers[last].size;
+  uint64_t size_image = fs::file_size(config.path_file_binary);
+  uint64_t size_layer = fs::file_size(path_file_layer);
+  Layer layer
+  {
+      .offset = offset_begin + sizeof(uint64_t)
+    , .size = size_layer
+    , .format = format("dwarfs")
+    , .hash = hash(path_file_layer, 0, size_layer)
+    , .time_created = uint64_t(std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count())
+    , .hash_parent = (first > 0)? vec_layers[first-1].hash : 0
+  };
+  {
+    int fd_image = open(config.path_file_binary.c_str(), O_RDONLY | O_CLOEXEC);
+    int fd_layer = open(path_file_layer.c_str(), O_RDONLY | O_CLOEXEC);
+    int fd_image_new = open(path_file_image.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0700);
+    std::error<std::string> error;
+    if ( fd_image < 0 or fd_layer < 0 or fd_image_new < 0 )
+    {
+      error = "Could not open files to squash the image: {}"_fmt(strerror(errno));
+    } // if
+    // Copied in the kernel where the filesystem allows it
+    if ( not error ) { error = ns_linux::copy_range(fd_image, fd_image_new, 0, offset_begin); }
+    if ( not error and ::write(fd_image_new, &size_layer, sizeof(size_layer)) != ssize_t(sizeof(size_layer)) )
+    {
+      error = "Could not write to the image: {}"_fmt(strerror(errno));
+    } // if
+    if ( not error ) { error = ns_linux::copy_range(fd_layer, fd_image_new, 0, size_layer); }
+    if ( not error ) { error = ns_linux::copy_range(fd_image, fd_image_new, offset_end, size_image - offset_end); }
+    for(int fd : {fd_image, fd_layer, fd_image_new})
+    {
+      if ( fd >= 0 ) { close(fd); }
+    } // for
+    ethrow_if(error, *error);
+  }
+  // Update the layer table, the layers above the range move by the difference in size
+  int64_t delta = int64_t(layer.offset + layer.size) - int64_t(offset_end);
+  std::vector<Layer> vec_layers_new(vec_layers.begin(), vec_layers.begin() + first);
+  vec_layers_new.push_back(layer);
+  for(auto&& layer_above : vec_layers | std::views::drop(last + 1))
+  {
+    layer_above.offset += delta;
+    layer_above.hash_parent = vec_layers_new.back().hash;
+    vec_layers_new.push_back(layer_above);
+  } // for
+  auto error = ns_reserved::ns_layers::write(path_file_image, config.offset_layers.offset, config.offset_layers.size, vec_layers_new);
+  elog_if(error, "Could not update the layer table: {}"_fmt(*error));
+  // The profiles of the layers above the range move down
+  ns_config::FlatimageConfig config_new = config;
+  config_new.path_file_binary = path_file_image;
+  ns_cmd::ns_dwarfs::squash(config_new, first, last);
+  // Replace the image
+  fs::permissions(path_file_image, fs::status(config.path_file_binary).permissions());
+  int fd = open(path_file_image.c_str(), O_RDONLY | O_CLOEXEC);
+  ethrow_if(fd < 0, "Could not open '{}': {}"_fmt(path_file_image, strerror(errno)));
+  int ret_sync = fsync(fd);
+  close(fd);
+  ethrow_if(ret_sync < 0, "Could not sync '{}'"_fmt(path_file_image));
+  fs::rename(path_file_image, config.path_file_binary);
+  // The rename is only durable once the directory that has the image is synced
+  int fd_dir = open(config.path_file_binary.parent_path().c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  ethrow_if(fd_dir < 0, "Could not open '{}': {}"_fmt(config.path_file_binary.parent_path(), strerror(errno)));
+  ret_sync = fsync(fd_dir);
+  close(fd_dir);
+  ethrow_if(ret_sync < 0, "Could not sync '{}'"_fmt(config.path_file_binary.parent_path()));
+  fs::remove_all(path_dir_squash);
+  ns_log::info()("Squashed layers [{},{}], layers {} -> {}, image {} MiB -> {} MiB"
+    , first
+    , last
+    , vec_layers.size()
+    , vec_layers_new.size()
+    , size_image >> 20
+    , fs::file_size(config.path_file_binary) >> 20
+  );
+} // fn: squash() }}}
+
 } // namespace ns_layers
 
 /* vim: set expandtab fdm=marker ts=2 sw=2 tw=100 et :*/
@@ -9,6 +9,7 @@
 #include <filesystem>
 
 #include "../../cpp/lib/env.hpp"
+#include "../../cpp/std/exception.hpp"
 
 #ifndef FIM_DIST
 #define FIM_DIST "TRUNK"
@@ -68,6 +69,8 @@ struct FlatimageConfig
   Offset offset_permissions;
   Offset offset_notify;
   Offset offset_desktop;
+  Offset offset_dwarfs;
+  Offset offset_layers;
   Offset offset_desktop_image;
   uint64_t offset_filesystem;
   fs::path path_dir_global;
@@ -96,7 +99,9 @@ struct FlatimageConfig
   fs::path path_file_config_bindings;
   fs::path path_file_config_casefold;
 
-  uint32_t layer_compression_level;
+  std::string layer_compression_preset;
+  std::optional<uint32_t> opt_layer_compression_level;
+  std::string layer_compression_options;
 
   std::string env_path;
 }; // }}}
@@ -127,6 +132,10 @@ inline FlatimageConfig config()
   config.offset_notify            = { config.offset_permissions.offset + config.offset_permissions.size, 1 };
   // Desktop entry information, reserve 4096 bytes for json data
   config.offset_desktop           = { config.offset_notify.offset + config.offset_notify.size, 4096 };
+  // Mount profiles of the dwarfs layers, reserve 4096 bytes for json data
+  config.offset_dwarfs            = { config.offset_desktop.offset + config.offset_desktop.size, 4096 };
+  // Table of the layers appended to the image, reserve 16384 bytes for 340 entries
+  config.offset_layers            = { config.offset_dwarfs.offset + config.offset_dwarfs.size, 16384 };
   // Space reserved for desktop icon
   config.offset_desktop_image     = { config.offset_reserved + SIZE_RESERVED_TOTAL - SIZE_RESERVED_IMAGE, SIZE_RESERVED_IMAGE};
   config.offset_filesystem        = config.offset_reserved + SIZE_RESERVED_TOTAL;
@@ -179,10 +188,17 @@ inline FlatimageConfig config()
   config.env_path += ":{}"_fmt(config.path_dir_busybox.string());
   ns_env::set("PATH", config.env_path, ns_env::Replace::Y);
 
-  // Compression level configuration (goes from 0 to 10, default is 7)
-  config.layer_compression_level  = ns_exception::to_expected([]{ return std::stoi(ns_env::get_or_else("FIM_COMPRESSION_LEVEL", "7")); })
-    .value_or(7);
-  config.layer_compression_level = std::clamp(config.layer_compression_level, uint32_t{0}, uint32_t{10});
+  // Compression preset of the layers, the level (goes from 0 to 9, as the levels of mkdwarfs) and
+  // the options override the ones of the preset
+  config.layer_compression_preset = ns_env::get_or_else("FIM_COMPRESSION_PRESET", "balanced");
+  if ( auto level = ns_env::get("FIM_COMPRESSION_LEVEL") )
+  {
+    // An invalid level keeps the one of the preset
+    auto expected_level = ns_exception::to_expected([&]{ return uint32_t(std::clamp(std::stoi(level), 0, 9)); });
+    if ( expected_level ) { config.opt_layer_compression_level = *expected_level; }
+    else { ns_log::error()("Invalid FIM_COMPRESSION_LEVEL '{}', using the level of the preset", level); }
+  } // if
+  config.layer_compression_options = ns_env::get_or_else("FIM_COMPRESSION_OPTIONS", "");
 
   // Paths to the configuration files
   config.path_file_config_boot        = config.path_dir_config / "boot.json";
@@ -213,8 +229,11 @@ inline decltype(auto) get_mounted_layers(fs::path const& path_dir_layers)
     | std::views::filter([](auto&& e){ return fs::is_directory(e.path()); })
     | std::views::transform([](auto&& e){ return e.path(); })
     | std::ranges::to<std::vector<fs::path>>();
-  // Reverse sort
-  std::ranges::sort(vec_path_dir_layer, std::greater<>{});
+  // Reverse sort by the numeric index, so layer 10 comes before layer 2
+  std::ranges::sort(vec_path_dir_layer, std::greater<>{}, [](auto&& e)
+  {
+    return ns_exception::or_default([&]{ return std::stoull(e.filename().string()); });
+  });
   return vec_path_dir_layer;
 } // get_mounted_layers() }}}
 
@@ -5,6 +5,7 @@
 
 #pragma once
 
+#include <map>
 #include <memory>
 #include <fcntl.h>
 
@@ -13,7 +14,13 @@
 #include "../cpp/lib/squashfs.hpp"
 #include "../cpp/lib/dwarfs.hpp"
 #include "../cpp/lib/ciopfs.hpp"
+#include "../cpp/lib/trace.hpp"
 #include "./config/config.hpp"
+#include "cache.hpp"
+#include "cmd/dwarfs.hpp"
+#include "cmd/layers.hpp"
+#include "prefetch.hpp"
+#include "share.hpp"
 
 #include "config/config.hpp"
 
@@ -25,13 +32,28 @@ class Filesystems
 {
   private:
     fs::path m_path_dir_mount;
-    std::vector<fs::path> m_vec_path_dir_mountpoints;
+    // Mountpoints grouped in levels, each level is stacked on top of the previous ones and the
+    // mountpoints within a level are independent
+    std::vector<std::vector<fs::path>> m_vec_levels_mountpoints;
     std::vector<std::unique_ptr<ns_dwarfs::Dwarfs>> m_layers;
+    std::vector<uint64_t> m_vec_size_layers;
+    // Where the access share of the layers is recorded, set when cache rebalancing is enabled
+    std::optional<fs::path> m_opt_path_file_cache_usage;
+    // Access traces of the layers, recorded with FIM_PREFETCH_RECORD=1 and replayed otherwise
+    fs::path m_path_dir_prefetch;
+    bool m_is_prefetch_record;
+    std::unique_ptr<ns_prefetch::Prefetch> m_prefetch;
+    // Directory of the layers shared with other instances of the image, unset if not shared
+    std::optional<fs::path> m_opt_path_dir_shared;
     std::unique_ptr<ns_ciopfs::Ciopfs> m_ciopfs;
     std::unique_ptr<ns_overlayfs::Overlayfs> m_overlayfs;
     std::unique_ptr<ns_unionfs::UnionFs> m_unionfs;
     std::optional<pid_t> m_opt_pid_janitor;
-    uint64_t mount_dwarfs(fs::path const& path_dir_mount, fs::path const& path_file_binary, uint64_t offset);
+    uint64_t mount_dwarfs(fs::path const& path_dir_mount
+      , fs::path const& path_file_binary
+      , std::vector<ns_layers::Layer> const& vec_layers_image
+      , nlohmann::json const& json_profiles
+    );
     void mount_ciopfs(fs::path const& path_dir_lower, fs::path const& path_dir_upper);
     void mount_unionfs(std::vector<fs::path> const& vec_path_dir_layer
       , fs::path const& path_dir_data
@@ -59,8 +81,26 @@ class Filesystems
 inline Filesystems::Filesystems(ns_config::FlatimageConfig const& config)
   : m_path_dir_mount(config.path_dir_mount)
 {
+  ns_trace::Span span("mount");
+  // Rebalance the dwarfs caches with the access share recorded in the previous launch
+  if ( ns_env::exists("FIM_CACHE_REBALANCE", "1") )
+  {
+    m_opt_path_file_cache_usage = config.path_dir_host_config / "cache.json";
+  } // if
+  m_path_dir_prefetch = config.path_dir_host_config / "prefetch";
+  m_is_prefetch_record = ns_env::exists("FIM_PREFETCH_RECORD", "1");
+  // Share the layers with other instances, unless the daemons record the traces or the reads of
+  // this one, shared daemons are detached and outlive it
+  if ( not m_is_prefetch_record and not m_opt_path_file_cache_usage and not ns_env::exists("FIM_SHARE_LAYERS", "0") )
+  {
+    m_opt_path_dir_shared = config.path_dir_app / "shared";
+  } // if
   // Mount compressed layers
-  uint64_t index_fs = mount_dwarfs(config.path_dir_mount_layers, config.path_file_binary, config.offset_filesystem);
+  uint64_t index_fs = mount_dwarfs(config.path_dir_mount_layers
+    , config.path_file_binary
+    , ns_layers::stack(config)
+    , ns_cmd::ns_dwarfs::read(config)
+  );
   // Push config files to upper directories if they do not exist in it
   ns_config::push_config_files(config.path_dir_mount_layers, config.path_dir_upper_overlayfs);
   // Check if should mount ciopfs
@@ -97,6 +137,36 @@ inline Filesystems::Filesystems(ns_config::FlatimageConfig const& config)
 // fn: Filesystems::Filesystems {{{
 inline Filesystems::~Filesystems()
 {
+  ns_trace::Span span("unmount");
+  auto time_beg = std::chrono::steady_clock::now();
+  // Stop the prefetch, it holds files open in the layers
+  m_prefetch.reset();
+  // Record the access share of the layers for the next launch
+  if ( m_opt_path_file_cache_usage and not m_layers.empty() )
+  {
+    std::vector<uint64_t> vec_bytes_read = m_layers
+      | std::views::transform([](auto&& e){ return e->get_pid().and_then(ns_cache::bytes_read).value_or(0); })
+      | std::ranges::to<std::vector<uint64_t>>();
+    auto error = ns_cache::write_usage(*m_opt_path_file_cache_usage, m_vec_size_layers, vec_bytes_read);
+    elog_if(error, *error);
+  } // if
+  // Detach from the top level to the bottom one, the mountpoints of a level in parallel, the
+  // destructors of the mounts then only stop their daemons. Shared layers are left to the last
+  // instance that references them.
+  for(auto&& vec_path_dir_mountpoints : m_vec_levels_mountpoints
+    | std::views::drop(m_opt_path_dir_shared? 1 : 0)
+    | std::views::reverse)
+  {
+    ns_fuse::unmount(vec_path_dir_mountpoints);
+  } // for
+  if ( m_opt_path_dir_shared and not m_vec_levels_mountpoints.empty() )
+  {
+    ns_share::detach(*m_opt_path_dir_shared, getpid(), m_vec_levels_mountpoints.front());
+  } // if
+  ns_log::debug()("Teardown of filesystems took {}ms"
+    , std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - time_beg).count()
+  );
+  // Janitor finds nothing to un-mount on a clean exit
   if ( m_opt_pid_janitor and *m_opt_pid_janitor > 0)
   {
     // Stop janitor loop & wait for cleanup
@@ -117,8 +187,9 @@ inline Filesystems::~Filesystems()
 // fn: spawn_janitor {{{
 inline void Filesystems::spawn_janitor()
 {
-  // Find janitor binary
-  fs::path path_file_janitor = fs::path{ns_env::get_or_throw("FIM_DIR_APP_BIN")} / "janitor";
+  // Find janitor binary, it could be in memory
+  fs::path path_file_janitor = ns_payload::memfd_path("janitor")
+    .value_or(fs::path{ns_env::get_or_throw("FIM_DIR_APP_BIN")} / "janitor");
 
   // Fork and execve into the janitor process
   pid_t pid_parent = getpid();
@@ -143,11 +214,21 @@ inline void Filesystems::spawn_janitor()
 
   // Keep parent pid in a variable
   ns_env::set("PID_PARENT", pid_parent, ns_env::Replace::Y);
+  // The bottom level is shared with other instances
+  if ( m_opt_path_dir_shared )
+  {
+    ns_env::set("FIM_DIR_LAYERS_SHARED", *m_opt_path_dir_shared, ns_env::Replace::Y);
+  } // if
 
   // Create args to janitor
   std::vector<std::string> vec_argv_custom;
-  vec_argv_custom.push_back(path_file_janitor);
-  std::copy(m_vec_path_dir_mountpoints.rbegin(), m_vec_path_dir_mountpoints.rend(), std::back_inserter(vec_argv_custom));
+  vec_argv_custom.push_back(ns_payload::memfd_name(path_file_janitor).value_or(path_file_janitor));
+  // Levels are passed from the top to the bottom, separated by '--'
+  for(auto&& vec_path_dir_mountpoints : m_vec_levels_mountpoints | std::views::reverse)
+  {
+    if ( vec_argv_custom.size() > 1 ) { vec_argv_custom.push_back("--"); }
+    std::ranges::copy(vec_path_dir_mountpoints, std::back_inserter(vec_argv_custom));
+  } // for
   auto argv_custom = std::make_unique<const char*[]>(vec_argv_custom.size() + 1);
   argv_custom[vec_argv_custom.size()] = nullptr;
   std::ranges::transform(vec_argv_custom, argv_custom.get(), [](auto&& e) { return e.c_str(); });
@@ -160,53 +241,40 @@ inline void Filesystems::spawn_janitor()
 } // fn: spawn_janitor }}}
 
 // fn: mount_dwarfs {{{
-inline uint64_t Filesystems::mount_dwarfs(fs::path const& path_dir_mount, fs::path const& path_file_binary, uint64_t offset)
+inline uint64_t Filesystems::mount_dwarfs(fs::path const& path_dir_mount
+  , fs::path const& path_file_binary
+  , std::vector<ns_layers::Layer> const& vec_layers_image
+  , nlohmann::json const& json_profiles)
 {
-  // Open the main binary
-  std::ifstream file_binary(path_file_binary, std::ios::binary);
-
   // Filesystem index
   uint64_t index_fs{};
 
-  auto f_mount = [this](fs::path path_file_binary, fs::path const& path_dir_mount, uint64_t index_fs, uint64_t offset, uint64_t size_fs)
+  // Compressed layers are independent of each other
+  m_vec_levels_mountpoints.emplace_back();
+
+  // Layers are collected first, so the cache budget can be split across all of them
+  struct Layer
   {
-    // Create mountpoint
-    fs::path path_dir_mount_index = path_dir_mount / std::to_string(index_fs);
-    lec(fs::create_directories,path_dir_mount_index);
-    // Mount filesystem
-    ns_log::debug()("Offset to filesystem is '{}'", offset);
-    this->m_layers.emplace_back(std::make_unique<ns_dwarfs::Dwarfs>(path_file_binary
-      , path_dir_mount_index
-      , offset
-      , size_fs
-      , getpid()
-    ));
-    // Include in mountpoints vector
-    m_vec_path_dir_mountpoints.push_back(path_dir_mount_index);
+    fs::path path_file_binary;
+    uint64_t index_fs;
+    uint64_t offset;
+    uint64_t size_fs;
   };
+  std::vector<Layer> vec_layers;
 
-  // Advance offset
-  file_binary.seekg(offset);
+  auto f_mount = [&](fs::path path_file_binary, uint64_t index_fs, uint64_t offset, uint64_t size_fs)
+  {
+    vec_layers.push_back(Layer{path_file_binary, index_fs, offset, size_fs});
+  };
 
-  // Mount filesystem concatenated in the image itself
-  while (true)
+  // Mount filesystems concatenated in the image itself
+  for(auto&& layer : vec_layers_image)
   {
-    // Read filesystem size
-    int64_t size_fs;
-    dbreak_if(not file_binary.read(reinterpret_cast<char*>(&size_fs), sizeof(size_fs)), "Stopped reading at index {}"_fmt(index_fs));
-    ns_log::debug()("Filesystem size is '{}'", size_fs);
-    // Skip size bytes
-    offset += 8;
-    // Check if filesystem is of type 'DWARFS'
-    ebreak_if(not ns_dwarfs::is_dwarfs(path_file_binary, offset), "Invalid dwarfs filesystem appended on the image");
-    // Mount filesystem
-    f_mount(path_file_binary, path_dir_mount, index_fs, offset, size_fs);
-    // Go to next filesystem if exists
+    ns_log::debug()("Filesystem size is '{}'", layer.size);
+    ebreak_if(ns_layers::format_name(layer) != "dwarfs", "Invalid dwarfs filesystem appended on the image");
+    f_mount(path_file_binary, index_fs, layer.offset, layer.size);
     index_fs += 1;
-    offset += size_fs;
-    file_binary.seekg(offset);
-  } // while
-  file_binary.close();
+  } // for
 
   // Get layers from layer directories
   std::vector<fs::path> vec_path_file_layer = ns_env::get_optional("FIM_DIRS_LAYER")
@@ -242,11 +310,155 @@ inline uint64_t Filesystems::mount_dwarfs(fs::path const& path_dir_mount, fs::pa
     // Check if filesystem is of type 'DWARFS'
     econtinue_if(not ns_dwarfs::is_dwarfs(path_file_layer, 0), "Invalid dwarfs filesystem appended on the image");
     // Mount file as a filesystem
-    f_mount(path_file_layer, path_dir_mount, index_fs, 0, fs::file_size(path_file_layer));
+    f_mount(path_file_layer, index_fs, 0, fs::file_size(path_file_layer));
     // Go to next filesystem if exists
     index_fs += 1;
   } // for
 
+  // Split the cache budget, optionally by the access share observed in the last launch
+  m_vec_size_layers = vec_layers
+    | std::views::transform([](auto&& e){ return e.size_fs; })
+    | std::ranges::to<std::vector<uint64_t>>();
+  std::vector<uint64_t> vec_size_cache = ns_cache::split(ns_cache::budget()
+    , m_vec_size_layers
+    , m_opt_path_file_cache_usage?
+        ns_cache::read_usage(*m_opt_path_file_cache_usage, m_vec_size_layers)
+      : std::vector<uint64_t>{}
+  );
+
+  // Instances of the same image share the layers, the lock is held until this instance references
+  // them, so concurrent launches mount them once
+  fs::path path_dir_mount_layers = path_dir_mount;
+  std::unique_ptr<ns_share::Lock> lock_shared;
+  bool is_attached = false;
+  if ( m_opt_path_dir_shared )
+  {
+    m_opt_path_dir_shared = *m_opt_path_dir_shared / ns_share::key(vec_layers
+        | std::views::transform([](auto&& e){ return std::make_tuple(e.path_file_binary, e.offset, e.size_fs); })
+        | std::ranges::to<std::vector<std::tuple<fs::path,uint64_t,uint64_t>>>()
+      , json_profiles.dump()
+    );
+    lec(fs::create_directories, m_opt_path_dir_shared->parent_path());
+    lock_shared = std::make_unique<ns_share::Lock>(*m_opt_path_dir_shared);
+    path_dir_mount_layers = *m_opt_path_dir_shared / "layers";
+    std::vector<fs::path> vec_path_dir_shared = vec_layers
+      | std::views::transform([&](auto&& e){ return path_dir_mount_layers / std::to_string(e.index_fs); })
+      | std::ranges::to<std::vector<fs::path>>();
+    is_attached = std::ranges::all_of(vec_path_dir_shared, [](auto&& e){ return ns_fuse::is_fuse(e).value_or(false); });
+    ns_log::debug()("{} shared layers in '{}'", is_attached? "Attach to" : "Mount", *m_opt_path_dir_shared);
+    // Unreferenced mounts were left by instances killed with their janitors. Incomplete mounts in
+    // use by another instance are left alone, and this instance mounts its own layers.
+    if ( not is_attached and ns_share::release(*m_opt_path_dir_shared, getpid()) )
+    {
+      ns_fuse::unmount(vec_path_dir_shared);
+    } // if
+    else if ( not is_attached )
+    {
+      ns_log::error()("Shared layers in '{}' are incomplete", *m_opt_path_dir_shared);
+      lock_shared.reset();
+      m_opt_path_dir_shared.reset();
+      path_dir_mount_layers = path_dir_mount;
+    } // else if
+  } // if
+
+  // Layers are spawned in index order and their mounts are awaited together
+  std::vector<std::pair<fs::path,std::optional<pid_t>>> vec_mount_pending;
+  std::vector<std::unique_ptr<ns_subprocess::Subprocess>> vec_subprocess_detached;
+  std::map<fs::path,fs::path> map_mount_source;
+  for(auto&& [layer, size_cache] : std::views::zip(vec_layers, vec_size_cache))
+  {
+    fs::path path_dir_mount_index = path_dir_mount_layers / std::to_string(layer.index_fs);
+    // Include in mountpoints of the layer level
+    m_vec_levels_mountpoints.back().push_back(path_dir_mount_index);
+    qcontinue_if(is_attached);
+    // Create mountpoint
+    lec(fs::create_directories,path_dir_mount_index);
+    // Spawn filesystem
+    ns_log::debug()("Offset to filesystem is '{}'", layer.offset);
+    ns_log::debug()("Cache size of layer '{}' is {} MiB", layer.index_fs, size_cache >> 20);
+    std::vector<std::string> vec_options = ns_cmd::ns_dwarfs::options(json_profiles, layer.index_fs);
+    // Record the files read from the layer, dwarfs writes them on exit
+    if ( m_is_prefetch_record )
+    {
+      lec(fs::create_directories, m_path_dir_prefetch);
+      vec_options.push_back("analysis_file={}"_fmt(ns_prefetch::path_file_trace(m_path_dir_prefetch, layer.index_fs, layer.size_fs)));
+    } // if
+    ns_log::debug()("Mount profile of layer '{}' is '{}'", layer.index_fs, vec_options);
+    ns_trace::Span span("spawn layer {}"_fmt(layer.index_fs));
+    // A shared daemon outlives this instance, it detaches once the layer is mounted
+    if ( m_opt_path_dir_shared )
+    {
+      vec_subprocess_detached.push_back(ns_dwarfs::spawn_detached(layer.path_file_binary
+        , path_dir_mount_index
+        , layer.offset
+        , layer.size_fs
+        , size_cache
+        , vec_options
+      ));
+      vec_mount_pending.emplace_back(path_dir_mount_index, vec_subprocess_detached.back()->get_pid());
+    } // if
+    else
+    {
+      this->m_layers.emplace_back(std::make_unique<ns_dwarfs::Dwarfs>(layer.path_file_binary
+        , path_dir_mount_index
+        , layer.offset
+        , layer.size_fs
+        , size_cache
+        , vec_options
+        , getpid()
+      ));
+      vec_mount_pending.emplace_back(path_dir_mount_index, this->m_layers.back()->get_pid());
+    } // else
+    map_mount_source[path_dir_mount_index] = layer.path_file_binary;
+  } // for
+
+  // Wait for all layers to mount
+  ns_trace::Span span("wait fuse");
+  std::vector<fs::path> vec_path_dir_failed = ns_fuse::wait_fuse(vec_mount_pending);
+  for(fs::path const& path_dir_failed : vec_path_dir_failed)
+  {
+    ns_log::error()("Failed to mount layer '{}' from '{}'", path_dir_failed.filename(), map_mount_source[path_dir_failed]);
+  } // for
+  for(auto&& path_dir_mount_index : vec_mount_pending | std::views::keys)
+  {
+    qcontinue_if(std::ranges::contains(vec_path_dir_failed, path_dir_mount_index));
+    ns_fuse::tune(path_dir_mount_index, "dwarfs");
+  } // for
+
+  // Reference the shared layers and expose them in the mountpoint of this instance
+  if ( m_opt_path_dir_shared )
+  {
+    ns_share::attach(*m_opt_path_dir_shared, getpid());
+    lock_shared.reset();
+    lec(fs::create_directories, path_dir_mount);
+    for(auto&& layer : vec_layers)
+    {
+      lec(fs::create_directory_symlink
+        , path_dir_mount_layers / std::to_string(layer.index_fs)
+        , path_dir_mount / std::to_string(layer.index_fs)
+      );
+    } // for
+  } // if
+
+  // Read the recorded files in the background while the sandbox is set up, attached layers were
+  // already warmed by the instance that mounted them
+  if ( not m_is_prefetch_record and not is_attached and not ns_env::exists("FIM_PREFETCH", "0") )
+  {
+    std::vector<fs::path> vec_path_file_prefetch;
+    for(auto&& layer : vec_layers)
+    {
+      fs::path path_file_trace = ns_prefetch::path_file_trace(m_path_dir_prefetch, layer.index_fs, layer.size_fs);
+      qcontinue_if(not fs::exists(path_file_trace));
+      ns_vector::append_range(vec_path_file_prefetch
+        , ns_prefetch::read(path_file_trace, path_dir_mount / std::to_string(layer.index_fs))
+      );
+    } // for
+    if ( not vec_path_file_prefetch.empty() )
+    {
+      m_prefetch = std::make_unique<ns_prefetch::Prefetch>(std::move(vec_path_file_prefetch));
+    } // if
+  } // if
+
   return index_fs;
 } // fn: mount_dwarfs }}}
 
@@ -261,7 +473,7 @@ inline void Filesystems::mount_unionfs(std::vector<fs::path> const& vec_path_dir
     , path_dir_mount
     , getpid()
   );
-  m_vec_path_dir_mountpoints.push_back(path_dir_mount);
+  m_vec_levels_mountpoints.push_back({path_dir_mount});
 } // fn: mount_unionfs }}}
 
 // fn: mount_overlayfs {{{
@@ -276,14 +488,14 @@ inline void Filesystems::mount_overlayfs(std::vector<fs::path> const& vec_path_d
     , path_dir_workdir
     , getpid()
   );
-  m_vec_path_dir_mountpoints.push_back(path_dir_mount);
+  m_vec_levels_mountpoints.push_back({path_dir_mount});
 } // fn: mount_overlayfs }}}
 
 // fn: mount_ciopfs {{{
 inline void Filesystems::mount_ciopfs(fs::path const& path_dir_lower, fs::path const& path_dir_upper)
 {
   this->m_ciopfs = std::make_unique<ns_ciopfs::Ciopfs>(path_dir_lower, path_dir_upper);
-  m_vec_path_dir_mountpoints.push_back(path_dir_upper);
+  m_vec_levels_mountpoints.push_back({path_dir_upper});
 } // fn: mount_ciopfs }}}
 
 } // namespace ns_filesystems
@@ -0,0 +1,43 @@
+///
+// @author      : Ruan E. Formigoni (ruanformigoni@gmail.com)
+// @file        : image
+///
+
+// Image processing lives in its own helper, so the boot program does not carry the jpeg, png
+// and zlib codecs. It is extracted from the image on the first desktop integration.
+
+#include <filesystem>
+
+#include "../cpp/lib/image.hpp"
+#include "../cpp/lib/log.hpp"
+#include "../cpp/macro.hpp"
+#include "../cpp/common.hpp"
+
+namespace fs = std::filesystem;
+
+// Usage: fim_image resize <src> <dst> <width> <height> [--preserve-aspect-ratio]
+int main(int argc, char const* argv[])
+{
+  ereturn_if(argc < 6 or std::string_view{argv[1]} != "resize", "Incorrect usage", EXIT_FAILURE);
+
+  bool is_preserve_aspect_ratio = (argc > 6 and std::string_view{argv[6]} == "--preserve-aspect-ratio");
+
+  uint32_t width, height;
+  try
+  {
+    width = std::stoul(argv[4]);
+    height = std::stoul(argv[5]);
+  } // try
+  catch(std::exception const& e)
+  {
+    ns_log::error()("Invalid image dimensions '{}x{}': {}", argv[4], argv[5], e.what());
+    return EXIT_FAILURE;
+  } // catch
+
+  auto result = ns_image::resize(fs::path{argv[2]}, fs::path{argv[3]}, width, height, is_preserve_aspect_ratio);
+  ereturn_if(not result.has_value(), result.error(), EXIT_FAILURE);
+
+  return EXIT_SUCCESS;
+} // main
+
+/* vim: set expandtab fdm=marker ts=2 sw=2 tw=100 et :*/
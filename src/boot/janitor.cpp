@@ -7,12 +7,14 @@
 #include <chrono>
 #include <filesystem>
 #include <csignal>
+#include <ranges>
 
 #include "../cpp/lib/log.hpp"
 #include "../cpp/lib/env.hpp"
 #include "../cpp/lib/fuse.hpp"
 #include "../cpp/macro.hpp"
 #include "../cpp/common.hpp"
+#include "share.hpp"
 
 namespace fs = std::filesystem;
 
@@ -49,11 +51,23 @@ int main(int argc, char const* argv[])
   } // while
   ns_log::info()("Parent process with pid '{}' finished", pid_parent);
 
-  // Cleanup mountpoints
-  for (auto&& path_dir_mountpoint : std::vector<fs::path>(argv+1, argv+argc))
+  // Cleanup mountpoints, levels are separated by '--' from the top to the bottom, the
+  // mountpoints of a level are un-mounted in parallel
+  auto vec_levels = std::vector<std::string>(argv+1, argv+argc)
+    | std::views::split(std::string{"--"})
+    | std::views::transform([](auto&& e){ return e | std::ranges::to<std::vector<fs::path>>(); })
+    | std::ranges::to<std::vector<std::vector<fs::path>>>();
+  auto opt_path_dir_shared = ns_env::get_optional("FIM_DIR_LAYERS_SHARED");
+  for (auto&& [index, vec_path_dir_mountpoints] : vec_levels | std::views::enumerate)
   {
-    ns_log::info()("Un-mount '{}'", path_dir_mountpoint);
-    ns_fuse::unmount(path_dir_mountpoint);
+    std::ranges::for_each(vec_path_dir_mountpoints, [](auto&& e){ ns_log::info()("Un-mount '{}'", e); });
+    // The bottom level is shared with other instances of the image, the last one un-mounts it
+    if ( opt_path_dir_shared and index + 1 == std::ssize(vec_levels) )
+    {
+      ns_share::detach(*opt_path_dir_shared, pid_parent, vec_path_dir_mountpoints);
+      continue;
+    } // if
+    ns_fuse::unmount(vec_path_dir_mountpoints);
   } // for
 
   // Exit child
@@ -0,0 +1,222 @@
+///
+// @author      : Ruan E. Formigoni (ruanformigoni@gmail.com)
+// @file        : manifest
+///
+
+#pragma once
+
+#include <map>
+#include <tuple>
+#include <optional>
+#include <filesystem>
+#include <fstream>
+#include <algorithm>
+#include <sys/stat.h>
+#include <nlohmann/json.hpp>
+
+#include "../cpp/lib/log.hpp"
+#include "../cpp/lib/payload.hpp"
+#include "../cpp/macro.hpp"
+#include "../cpp/common.hpp"
+
+// The manifest is written after a successful extraction of the helpers, so a warm boot checks a
+// single file instead of re-creating every helper and symlink
+namespace ns_manifest
+{
+
+namespace
+{
+
+namespace fs = std::filesystem;
+
+using json_t = nlohmann::json;
+
+constexpr uint64_t const VERSION = 2;
+
+// fnv1a() {{{
+inline std::string fnv1a(std::string_view data)
+{
+  uint64_t hash = 0xcbf29ce484222325;
+  for(unsigned char c : data)
+  {
+    hash ^= c;
+    hash *= 0x100000001b3;
+  } // for
+  return "{:016x}"_fmt(hash);
+} // fnv1a() }}}
+
+} // namespace
+
+// struct Identity {{{
+// Identifies a file without reading it, the store entries are never modified in place
+struct Identity
+{
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t size;
+  // Modification time in nanoseconds
+  int64_t mtime;
+
+  bool operator==(Identity const&) const = default;
+}; // struct Identity }}}
+
+// struct Manifest {{{
+struct Manifest
+{
+  // Start of the reserved space of the image
+  uint64_t offset_end;
+  // Image the offset was read from
+  Identity image;
+  // Helpers and the store entries they link to
+  std::map<std::string,Identity> helpers;
+  // Modification time of the busybox directory in nanoseconds, only the extraction writes to it
+  int64_t mtime_busybox;
+}; // struct Manifest }}}
+
+// identity() {{{
+// Identity of the file, links are followed
+[[nodiscard]] inline std::optional<Identity> identity(fs::path const& path_file)
+{
+  struct stat st;
+  qreturn_if(::stat(path_file.c_str(), &st) < 0, std::nullopt);
+  return Identity
+  {
+      .dev = uint64_t(st.st_dev)
+    , .ino = uint64_t(st.st_ino)
+    , .size = uint64_t(st.st_size)
+    , .mtime = int64_t(st.st_mtim.tv_sec) * 1'000'000'000 + st.st_mtim.tv_nsec
+  };
+} // identity() }}}
+
+// mtime() {{{
+// Modification time in nanoseconds, changes when an entry is created or removed in the directory
+[[nodiscard]] inline int64_t mtime(fs::path const& path_dir)
+{
+  struct stat st;
+  qreturn_if(stat(path_dir.c_str(), &st) < 0, -1);
+  return int64_t(st.st_mtim.tv_sec) * 1'000'000'000 + st.st_mtim.tv_nsec;
+} // mtime() }}}
+
+// read() {{{
+[[nodiscard]] inline std::expected<Manifest,std::string> read(fs::path const& path_file_manifest)
+{
+  std::ifstream file(path_file_manifest);
+  qreturn_if(not file.is_open(), std::unexpected("Could not open manifest '{}'"_fmt(path_file_manifest)));
+  json_t json = json_t::parse(file, nullptr, false);
+  qreturn_if(json.is_discarded() or not json.is_object(), std::unexpected("Could not parse manifest"));
+  qreturn_if(json.value("version", uint64_t{0}) != VERSION, std::unexpected("Manifest version mismatch"));
+  qreturn_if(not json.contains("content") or not json.contains("checksum"), std::unexpected("Incomplete manifest"));
+  qreturn_if(fnv1a(json["content"].dump()) != json["checksum"], std::unexpected("Manifest checksum mismatch"));
+  try
+  {
+    auto f_identity = [](json_t const& json_identity)
+    {
+      auto [dev, ino, size, mtime] = json_identity.get<std::tuple<uint64_t,uint64_t,uint64_t,int64_t>>();
+      return Identity{ .dev = dev, .ino = ino, .size = size, .mtime = mtime };
+    };
+    Manifest manifest
+    {
+        .offset_end = json["content"]["offset_end"].get<uint64_t>()
+      , .image = f_identity(json["content"]["image"])
+      , .helpers = {}
+      , .mtime_busybox = json["content"]["mtime_busybox"].get<int64_t>()
+    };
+    for(auto&& [name_helper, json_identity] : json["content"]["helpers"].items())
+    {
+      manifest.helpers.emplace(name_helper, f_identity(json_identity));
+    } // for
+    return manifest;
+  } // try
+  catch(std::exception const& e)
+  {
+    return std::unexpected("Invalid manifest: {}"_fmt(e.what()));
+  } // catch
+} // read() }}}
+
+// write() {{{
+// Writes the manifest atomically, concurrent launches could be writing it as well
+[[nodiscard]] inline std::error<std::string> write(fs::path const& path_file_manifest, Manifest const& manifest)
+{
+  auto f_identity = [](Identity const& identity)
+  {
+    return json_t::array({identity.dev, identity.ino, identity.size, identity.mtime});
+  };
+  json_t json_content;
+  json_content["offset_end"] = manifest.offset_end;
+  json_content["image"] = f_identity(manifest.image);
+  json_content["helpers"] = json_t::object();
+  for(auto&& [name_helper, identity] : manifest.helpers)
+  {
+    json_content["helpers"][name_helper] = f_identity(identity);
+  } // for
+  json_content["mtime_busybox"] = manifest.mtime_busybox;
+  json_t json;
+  json["version"] = VERSION;
+  json["checksum"] = fnv1a(json_content.dump());
+  json["content"] = json_content;
+  fs::path path_file_tmp = "{}.{}"_fmt(path_file_manifest, getpid());
+  std::ofstream file(path_file_tmp, std::ios::trunc);
+  qreturn_if(not file.is_open(), "Could not open '{}' for writing"_fmt(path_file_tmp));
+  file << json.dump(2);
+  file.close();
+  std::error_code ec;
+  fs::rename(path_file_tmp, path_file_manifest, ec);
+  qreturn_if(ec, "Could not rename '{}' to '{}': {}"_fmt(path_file_tmp, path_file_manifest, ec.message()));
+  return std::nullopt;
+} // write() }}}
+
+// create() {{{
+// Manifest of the extracted helpers, with the identities validate() compares against
+[[nodiscard]] inline std::expected<Manifest,std::string> create(uint64_t offset_end
+  , fs::path const& path_file_binary
+  , fs::path const& path_dir_busybox
+  , std::vector<std::string> const& vec_name_helper)
+{
+  auto opt_identity_image = identity(path_file_binary);
+  qreturn_if(not opt_identity_image, std::unexpected("Could not stat '{}'"_fmt(path_file_binary)));
+  Manifest manifest
+  {
+      .offset_end = offset_end
+    , .image = *opt_identity_image
+    , .helpers = {}
+    , .mtime_busybox = mtime(path_dir_busybox)
+  };
+  for(auto&& name_helper : vec_name_helper)
+  {
+    auto opt_path_file_helper = ns_payload::path_file_target(name_helper);
+    qreturn_if(not opt_path_file_helper, std::unexpected("Could not find target directory for '{}'"_fmt(name_helper)));
+    auto opt_identity = identity(*opt_path_file_helper);
+    qreturn_if(not opt_identity, std::unexpected("Could not stat '{}'"_fmt(*opt_path_file_helper)));
+    manifest.helpers.emplace(name_helper, *opt_identity);
+  } // for
+  return manifest;
+} // create() }}}
+
+// validate() {{{
+// Checks that the manifest was written for this image and that the store entries of the required
+// helpers were not replaced. The bin directory is not checked, helpers extracted on first use
+// create links in it.
+[[nodiscard]] inline std::error<std::string> validate(Manifest const& manifest
+  , fs::path const& path_file_binary
+  , fs::path const& path_dir_busybox
+  , std::vector<std::string> const& vec_name_helper)
+{
+  qreturn_if(identity(path_file_binary) != manifest.image, "Image '{}' was modified"_fmt(path_file_binary));
+  qreturn_if(mtime(path_dir_busybox) != manifest.mtime_busybox, "Directory '{}' was modified"_fmt(path_dir_busybox));
+  for(auto&& name_helper : vec_name_helper)
+  {
+    auto it = manifest.helpers.find(name_helper);
+    qreturn_if(it == manifest.helpers.end(), "Helper '{}' is not in the manifest"_fmt(name_helper));
+    // Helpers link to the store, which could have been cleaned up while the directories were kept
+    auto opt_path_file_helper = ns_payload::path_file_target(name_helper);
+    qreturn_if(not opt_path_file_helper, "Could not find target directory for '{}'"_fmt(name_helper));
+    qreturn_if(identity(*opt_path_file_helper) != it->second
+      , "Helper '{}' does not match the manifest"_fmt(*opt_path_file_helper)
+    );
+  } // for
+  return std::nullopt;
+} // validate() }}}
+
+} // namespace ns_manifest
+
+/* vim: set expandtab fdm=marker ts=2 sw=2 tw=100 et :*/
@@ -23,8 +23,11 @@
 #include "cmd/layers.hpp"
 #include "cmd/desktop.hpp"
 #include "cmd/bind.hpp"
+#include "cmd/dwarfs.hpp"
+#include "cmd/bench.hpp"
 #include "cmd/help.hpp"
 #include "filesystems.hpp"
+#include "scheduler.hpp"
 
 namespace ns_parser
 {
@@ -77,7 +80,7 @@ struct CmdBoot
   std::vector<std::string> args;
 };
 
-ENUM(CmdLayerOp,CREATE,ADD);
+ENUM(CmdLayerOp,CREATE,ADD,LIST,SQUASH,PROBE);
 struct CmdLayer
 {
   CmdLayerOp op;
@@ -112,6 +115,8 @@ using CmdType = std::variant<CmdRoot
   , CmdCommit
   , CmdNotify
   , CmdCaseFold
+  , ns_cmd::ns_dwarfs::CmdDwarfs
+  , ns_cmd::ns_bench::CmdBench
   , CmdBoot
   , CmdNone
 >;
@@ -216,10 +221,33 @@ inline std::expected<CmdType, std::string> parse(int argc , char** argv)
         f_error(argc < 4, ns_cmd::ns_help::layer_usage(), "add requires exactly one argument");
         ns_vector::push_back(cmd.args, argv[3]);
       } // if
+      else if ( cmd.op == CmdLayerOp::LIST )
+      {
+        f_error(argc != 3, ns_cmd::ns_help::layer_usage(), "list does not take arguments");
+      } // else if
+      else if ( cmd.op == CmdLayerOp::SQUASH )
+      {
+        f_error(argc > 5, ns_cmd::ns_help::layer_usage(), "squash takes up to two arguments");
+        for(int i = 3; i < argc; ++i)
+        {
+          f_error(not std::ranges::all_of(std::string_view{argv[i]}, [](char c){ return std::isdigit(c); })
+            , ns_cmd::ns_help::layer_usage()
+            , "Invalid layer index '{}'"_fmt(argv[i])
+          );
+          ns_vector::push_back(cmd.args, argv[i]);
+        } // for
+      } // else if
+      else if ( cmd.op == CmdLayerOp::PROBE )
+      {
+        f_error(argc < 4, ns_cmd::ns_help::layer_usage(), "probe requires an input directory");
+        for(int i = 3; i < argc; ++i) { ns_vector::push_back(cmd.args, argv[i]); }
+      } // else if
       else
       {
-        f_error(argc < 5, ns_cmd::ns_help::layer_usage(), "add requires exactly two arguments");
+        f_error(argc < 5 or argc > 6, ns_cmd::ns_help::layer_usage(), "create requires two or three arguments");
         ns_vector::push_back(cmd.args, argv[3], argv[4]);
+        // Optional file order
+        if ( argc == 6 ) { ns_vector::push_back(cmd.args, argv[5]); }
       } // else
       return CmdType(cmd);
     },
@@ -268,6 +296,49 @@ inline std::expected<CmdType, std::string> parse(int argc , char** argv)
       f_error(argc != 3, ns_cmd::ns_help::casefold_usage(), "Incorrect number of arguments");
       return CmdType(CmdCaseFold{CmdCaseFoldOp(argv[2])});
     },
+    // Configure the mount profiles of the compressed layers
+    ns_match::equal("fim-dwarfs") >>= [&]
+    {
+      f_error(argc < 3, ns_cmd::ns_help::dwarfs_usage(), "Incorrect number of arguments");
+      ns_cmd::ns_dwarfs::CmdDwarfs cmd;
+      cmd.op = ns_cmd::ns_dwarfs::CmdDwarfsOp(argv[2]);
+      // Number of arguments before the optional layer index
+      int count_args = ns_match::match(cmd.op
+        , ns_match::equal(ns_cmd::ns_dwarfs::CmdDwarfsOp::PRESET, ns_cmd::ns_dwarfs::CmdDwarfsOp::SET) >>= 4
+        , ns_match::equal(ns_cmd::ns_dwarfs::CmdDwarfsOp::CLEAR, ns_cmd::ns_dwarfs::CmdDwarfsOp::LIST) >>= 3
+      );
+      f_error(argc < count_args or argc > count_args + 1, ns_cmd::ns_help::dwarfs_usage(), "Incorrect number of arguments");
+      f_error(cmd.op == ns_cmd::ns_dwarfs::CmdDwarfsOp::LIST and argc != count_args
+        , ns_cmd::ns_help::dwarfs_usage()
+        , "list does not take a layer index"
+      );
+      if ( count_args == 4 ) { cmd.value = argv[3]; }
+      if ( argc > count_args )
+      {
+        f_error(not std::ranges::all_of(std::string_view{argv[count_args]}, [](char c){ return std::isdigit(c); })
+          , ns_cmd::ns_help::dwarfs_usage()
+          , "Invalid layer index"
+        );
+        cmd.opt_index_layer = std::stoull(argv[count_args]);
+      } // if
+      return CmdType(cmd);
+    },
+    // Measure the read throughput of the compressed layers
+    ns_match::equal("fim-bench") >>= [&]
+    {
+      f_error(argc > 3, ns_cmd::ns_help::bench_usage(), "Incorrect number of arguments");
+      ns_cmd::ns_bench::CmdBench cmd{ .count_threads = std::max(std::thread::hardware_concurrency(), 1u) };
+      if ( argc == 3 )
+      {
+        f_error(not std::ranges::all_of(std::string_view{argv[2]}, [](char c){ return std::isdigit(c); })
+          or std::stoul(argv[2]) == 0
+          , ns_cmd::ns_help::bench_usage()
+          , "Invalid number of threads"
+        );
+        cmd.count_threads = std::stoul(argv[2]);
+      } // if
+      return CmdType(cmd);
+    },
     // Set the default startup command
     ns_match::equal("fim-boot", "fim-cmd") >>= [&]
     {
@@ -289,6 +360,8 @@ inline std::expected<CmdType, std::string> parse(int argc , char** argv)
         ns_match::equal("commit")   >>= [&]{ f_error(true, ns_cmd::ns_help::commit_usage(), ""); },
         ns_match::equal("notify")   >>= [&]{ f_error(true, ns_cmd::ns_help::notify_usage(), ""); },
         ns_match::equal("casefold") >>= [&]{ f_error(true, ns_cmd::ns_help::casefold_usage(), ""); },
+        ns_match::equal("dwarfs")   >>= [&]{ f_error(true, ns_cmd::ns_help::dwarfs_usage(), ""); },
+        ns_match::equal("bench")    >>= [&]{ f_error(true, ns_cmd::ns_help::bench_usage(), ""); },
         ns_match::equal("boot")     >>= [&]{ f_error(true, ns_cmd::ns_help::boot_usage(), ""); }
       );
       return CmdType(CmdNone{});
@@ -310,13 +383,31 @@ inline int parse_cmds(ns_config::FlatimageConfig config, int argc, char** argv)
 
   auto f_bwrap_impl = [&](auto&& program, auto&& args)
   {
-    // Mount filesystems
-    auto mount = ns_filesystems::Filesystems(config);
-    // Execute specified command
-    auto environment = ns_exception::or_default([&]{ return ns_config::ns_environment::get(config.path_file_config_environment); });
+    std::unique_ptr<ns_filesystems::Filesystems> mount;
+    std::vector<std::string> environment;
+    decltype(permissions.get()) bits_permissions;
+    std::expected<fs::path,std::string> expected_path_file_bwrap;
+    // The bwrap probe and the configuration files do not depend on the mounted filesystems
+    ns_scheduler::Scheduler scheduler;
+    // Mount filesystems, the fuse processes die with the thread that spawned them
+    auto id_mount = scheduler.add("mount", {}, [&]
+    {
+      mount = std::make_unique<ns_filesystems::Filesystems>(config);
+    }, ns_scheduler::Affinity::MAIN);
+    // Environment of the command, the configuration files are copied to the upper directory by mount
+    std::ignore = scheduler.add("environment", {id_mount}, [&]
+    {
+      environment = ns_exception::or_default([&]{ return ns_config::ns_environment::get(config.path_file_config_environment); });
+    });
     // Read permissions
-    auto bits_permissions = permissions.get();
-    elog_if(not bits_permissions, bits_permissions.error());
+    std::ignore = scheduler.add("permissions", {}, [&]
+    {
+      bits_permissions = permissions.get();
+      elog_if(not bits_permissions, bits_permissions.error());
+    });
+    // Find a working bwrap binary
+    std::ignore = scheduler.add("bwrap probe", {}, [&]{ expected_path_file_bwrap = ns_bwrap::probe(); });
+    scheduler.run();
     // Check if should use bwrap native overlayfs
     std::optional<ns_bwrap::Overlay> bwrap_overlay = ( config.overlay_type == ns_config::OverlayType::BWRAP )?
         std::make_optional(ns_bwrap::Overlay
@@ -336,6 +427,7 @@ inline int parse_cmds(ns_config::FlatimageConfig config, int argc, char** argv)
       , environment);
     // Include root binding and custom user-defined bindings
     std::ignore = bwrap
+      .with_probe(expected_path_file_bwrap)
       .with_bind_ro("/", config.path_dir_runtime_host)
       .with_binds_from_file(config.path_file_config_bindings);
     // Check if should enable GPU
@@ -433,11 +525,31 @@ inline int parse_cmds(ns_config::FlatimageConfig config, int argc, char** argv)
   {
     if ( cmd->op == CmdLayerOp::ADD )
     {
-      ns_layers::add(config.path_file_binary, cmd->args.front());
+      ns_layers::add(config, cmd->args.front());
     } // if
+    else if ( cmd->op == CmdLayerOp::LIST )
+    {
+      ns_layers::list(config);
+    } // else if
+    else if ( cmd->op == CmdLayerOp::SQUASH )
+    {
+      auto f_index = [&](size_t i)
+      {
+        return (cmd->args.size() > i)? std::make_optional(std::stoull(cmd->args.at(i))) : std::nullopt;
+      };
+      ns_layers::squash(config, f_index(0), f_index(1));
+    } // else if
+    else if ( cmd->op == CmdLayerOp::PROBE )
+    {
+      ns_layers::probe(config, cmd->args.at(0), std::vector<std::string>(std::next(cmd->args.begin()), cmd->args.end()));
+    } // else if
     else
     {
-      ns_layers::create(cmd->args.at(0), cmd->args.at(1), config.layer_compression_level);
+      ns_layers::create(cmd->args.at(0)
+        , cmd->args.at(1)
+        , ns_cmd::ns_compression::args(config)
+        , (cmd->args.size() > 2)? std::make_optional(fs::path{cmd->args.at(2)}) : std::nullopt
+      );
     } // else
   } // else if
   // Bind a device or file to the flatimage
@@ -454,15 +566,23 @@ inline int parse_cmds(ns_config::FlatimageConfig config, int argc, char** argv)
   // Commit changes as a novel layer into the flatimage
   else if ( auto cmd = ns_variant::get_if_holds_alternative<ns_parser::CmdCommit>(*variant_cmd) )
   {
-    // Set source directory and target compressed file
-    fs::path path_file_layer = config.path_dir_host_config / "layer.tmp";
+    // Set source directory
     fs::path path_dir_src = config.path_dir_data_overlayfs / "upperdir";
-    // Create filesystem based on the contents of src
-    ns_layers::create(path_dir_src, path_file_layer, config.layer_compression_level);
-    // Include filesystem in the image
-    ns_layers::add(config.path_file_binary, path_file_layer);
-    // Remove compressed filesystem
-    fs::remove(path_file_layer);
+    // Leave out the files that are identical to the ones in the lower layers
+    fs::path path_dir_stage = config.path_dir_host_config / "layer.stage";
+    ns_layers::stage(config, path_dir_src, path_dir_stage);
+    // Lay out files in the order recorded by launches with FIM_PREFETCH_RECORD=1
+    fs::path path_file_order = config.path_dir_host_config / "layer.order";
+    std::vector<fs::path> vec_path_file_trace = ns_prefetch::list(config.path_dir_host_config / "prefetch");
+    bool is_ordered = ns_layers::order(vec_path_file_trace, path_dir_stage, path_file_order);
+    // Compress the staged changes straight into the image
+    ns_layers::append(config
+      , path_dir_stage
+      , ns_cmd::ns_compression::args(config)
+      , is_ordered? std::make_optional(path_file_order) : std::nullopt
+    );
+    fs::remove(path_file_order);
+    fs::remove_all(path_dir_stage);
     // Remove upper directory
     fs::remove_all(path_dir_src);
   } // else if
@@ -482,6 +602,23 @@ inline int parse_cmds(ns_config::FlatimageConfig config, int argc, char** argv)
       db("enable") = std::string{cmd->op};
     }, ns_db::Mode::UPDATE_OR_CREATE);
   } // else if
+  // Configure the mount profiles of the compressed layers
+  else if ( auto cmd = ns_variant::get_if_holds_alternative<ns_cmd::ns_dwarfs::CmdDwarfs>(*variant_cmd) )
+  {
+    switch(cmd->op)
+    {
+      case ns_cmd::ns_dwarfs::CmdDwarfsOp::PRESET: ns_cmd::ns_dwarfs::preset(config, cmd->value, cmd->opt_index_layer); break;
+      case ns_cmd::ns_dwarfs::CmdDwarfsOp::SET: ns_cmd::ns_dwarfs::set(config, cmd->value, cmd->opt_index_layer); break;
+      case ns_cmd::ns_dwarfs::CmdDwarfsOp::CLEAR: ns_cmd::ns_dwarfs::clear(config, cmd->opt_index_layer); break;
+      case ns_cmd::ns_dwarfs::CmdDwarfsOp::LIST: ns_cmd::ns_dwarfs::list(config); break;
+    } // switch
+  } // else if
+  // Measure the read throughput of the compressed layers
+  else if ( auto cmd = ns_variant::get_if_holds_alternative<ns_cmd::ns_bench::CmdBench>(*variant_cmd) )
+  {
+    [[maybe_unused]] auto mount = ns_filesystems::Filesystems(config);
+    ns_cmd::ns_bench::run(config.path_dir_mount_layers, cmd->count_threads);
+  } // else if
   // Update default command on database
   else if ( auto cmd = ns_variant::get_if_holds_alternative<ns_parser::CmdBoot>(*variant_cmd) )
   {
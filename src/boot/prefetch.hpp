@@ -0,0 +1,145 @@
+///
+// @author      : Ruan E. Formigoni (ruanformigoni@gmail.com)
+// @file        : prefetch
+///
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <fstream>
+#include <filesystem>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "../cpp/lib/log.hpp"
+#include "../cpp/lib/trace.hpp"
+#include "../cpp/std/exception.hpp"
+#include "../cpp/macro.hpp"
+#include "../cpp/common.hpp"
+
+// With FIM_PREFETCH_RECORD=1 the dwarfs daemons record the files a launch reads. Later launches
+// read the recorded files in the background while the sandbox is set up, so the blocks are
+// decompressed before the program asks for them.
+namespace ns_prefetch
+{
+
+namespace
+{
+
+namespace fs = std::filesystem;
+
+} // namespace
+
+// path_file_trace() {{{
+// The trace of a layer is keyed by its index and size, so it is dropped when the layer changes
+inline fs::path path_file_trace(fs::path const& path_dir_trace, uint64_t index_layer, uint64_t size_layer)
+{
+  return path_dir_trace / "{}-{}.list"_fmt(index_layer, size_layer);
+} // path_file_trace() }}}
+
+// list() {{{
+// Traces in the directory, from the bottom layer to the top one
+inline std::vector<fs::path> list(fs::path const& path_dir_trace)
+{
+  std::error_code ec;
+  std::vector<std::pair<uint64_t,fs::path>> vec_trace;
+  for(auto&& entry : fs::directory_iterator(path_dir_trace, ec))
+  {
+    qcontinue_if(entry.path().extension() != ".list");
+    auto expected_index = ns_exception::to_expected([&]{ return std::stoull(entry.path().stem().string()); });
+    qcontinue_if(not expected_index);
+    vec_trace.emplace_back(*expected_index, entry.path());
+  } // for
+  std::ranges::sort(vec_trace);
+  return vec_trace | std::views::values | std::ranges::to<std::vector<fs::path>>();
+} // list() }}}
+
+// read() {{{
+// Files of the trace as paths in the mountpoint of the layer
+inline std::vector<fs::path> read(fs::path const& path_file_trace, fs::path const& path_dir_mount)
+{
+  std::vector<fs::path> vec_path_file;
+  std::ifstream file(path_file_trace);
+  std::string line;
+  while ( std::getline(file, line) )
+  {
+    qcontinue_if(line.empty());
+    vec_path_file.push_back(path_dir_mount / fs::path{line}.relative_path());
+  } // while
+  return vec_path_file;
+} // read() }}}
+
+// class Prefetch {{{
+// Reads the files with a pool of threads, stops on destruction
+class Prefetch
+{
+  private:
+    std::vector<fs::path> m_vec_path_file;
+    std::atomic<size_t> m_index;
+    std::atomic<uint64_t> m_bytes;
+    std::chrono::steady_clock::time_point m_time_begin;
+    std::vector<std::jthread> m_vec_threads;
+
+    void worker(std::stop_token token);
+
+  public:
+    Prefetch(std::vector<fs::path> vec_path_file);
+    ~Prefetch();
+    Prefetch(Prefetch const&) = delete;
+    Prefetch& operator=(Prefetch const&) = delete;
+}; // class Prefetch }}}
+
+// Prefetch::Prefetch() {{{
+inline Prefetch::Prefetch(std::vector<fs::path> vec_path_file)
+  : m_vec_path_file(std::move(vec_path_file))
+  , m_index(0)
+  , m_bytes(0)
+  , m_time_begin(std::chrono::steady_clock::now())
+{
+  ns_log::debug()("Prefetch {} files", m_vec_path_file.size());
+  size_t count_threads = std::min<size_t>(std::max(std::thread::hardware_concurrency(), 1u), 4);
+  count_threads = std::min(count_threads, m_vec_path_file.size());
+  for(size_t i = 0; i < count_threads; ++i)
+  {
+    m_vec_threads.emplace_back([this](std::stop_token token){ worker(token); });
+  } // for
+} // Prefetch::Prefetch() }}}
+
+// Prefetch::~Prefetch() {{{
+inline Prefetch::~Prefetch()
+{
+  // Files must be closed before the layers are un-mounted
+  for(auto&& thread : m_vec_threads) { thread.request_stop(); }
+  for(auto&& thread : m_vec_threads) { thread.join(); }
+  ns_log::debug()("Prefetched {} of {} files ({} MiB) in {}ms"
+    , std::min(m_index.load(), m_vec_path_file.size())
+    , m_vec_path_file.size()
+    , m_bytes.load() >> 20
+    , std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - m_time_begin).count()
+  );
+} // Prefetch::~Prefetch() }}}
+
+// Prefetch::worker() {{{
+inline void Prefetch::worker(std::stop_token token)
+{
+  ns_trace::Span span("prefetch");
+  std::vector<char> buffer(1 << 20);
+  for(size_t i = m_index++; i < m_vec_path_file.size() and not token.stop_requested(); i = m_index++)
+  {
+    int fd = open(m_vec_path_file[i].c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    qcontinue_if(fd < 0);
+    // Reading through the daemon decompresses the blocks into its cache
+    ssize_t count;
+    while ( not token.stop_requested() and (count = ::read(fd, buffer.data(), buffer.size())) > 0 )
+    {
+      m_bytes += count;
+    } // while
+    close(fd);
+  } // for
+} // Prefetch::worker() }}}
+
+} // namespace ns_prefetch
+
+/* vim: set expandtab fdm=marker ts=2 sw=2 tw=100 et :*/
@@ -0,0 +1,203 @@
+///
+// @author      : Ruan E. Formigoni (ruanformigoni@gmail.com)
+// @file        : scheduler
+///
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../cpp/lib/log.hpp"
+#include "../cpp/lib/trace.hpp"
+#include "../cpp/macro.hpp"
+#include "../cpp/std/enum.hpp"
+#include "../cpp/common.hpp"
+
+// Runs the independent steps of the boot concurrently, respecting their dependencies
+namespace ns_scheduler
+{
+
+// ANY  : Runs in any thread
+// MAIN : Runs in the thread that called run(), required for steps that spawn processes with
+//        PR_SET_PDEATHSIG, which fires when the thread that forked them exits
+ENUM(Affinity, ANY, MAIN);
+
+// class Scheduler {{{
+class Scheduler
+{
+  private:
+    using clock_t = std::chrono::steady_clock;
+    struct Task
+    {
+      std::string name;
+      std::vector<size_t> vec_deps;
+      std::vector<size_t> vec_dependents;
+      std::function<void()> f;
+      Affinity affinity;
+      size_t count_deps_pending{0};
+      bool is_failed{false};
+      clock_t::time_point time_begin{};
+      clock_t::time_point time_end{};
+      std::exception_ptr exception{};
+    };
+    std::vector<Task> m_tasks;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<size_t> m_queue_any;
+    std::deque<size_t> m_queue_main;
+    size_t m_count_done{0};
+
+    void execute(size_t id);
+    void worker(Affinity affinity);
+    void log_critical_path();
+
+  public:
+    Scheduler() = default;
+    Scheduler(Scheduler const&) = delete;
+    Scheduler& operator=(Scheduler const&) = delete;
+
+    template<typename F>
+    [[nodiscard]] size_t add(std::string_view name, std::vector<size_t> const& vec_deps, F&& f, Affinity affinity = Affinity::ANY);
+    void run();
+}; // class Scheduler }}}
+
+// add() {{{
+// Adds a step that runs once all the steps in vec_deps finished successfully
+template<typename F>
+size_t Scheduler::add(std::string_view name, std::vector<size_t> const& vec_deps, F&& f, Affinity affinity)
+{
+  size_t id = m_tasks.size();
+  ethrow_if(std::ranges::any_of(vec_deps, [&](size_t dep){ return dep >= id; })
+    , "Step '{}' depends on a step that does not exist"_fmt(name)
+  );
+  m_tasks.push_back(Task
+  {
+      .name = std::string{name}
+    , .vec_deps = vec_deps
+    , .vec_dependents = {}
+    , .f = std::forward<F>(f)
+    , .affinity = affinity
+    , .count_deps_pending = vec_deps.size()
+  });
+  for(size_t dep : vec_deps) { m_tasks[dep].vec_dependents.push_back(id); }
+  return id;
+} // add() }}}
+
+// execute() {{{
+inline void Scheduler::execute(size_t id)
+{
+  Task& task = m_tasks[id];
+  // Skip steps with a failed dependency
+  if ( not task.is_failed )
+  {
+    task.time_begin = clock_t::now();
+    try
+    {
+      ns_trace::Span span(task.name);
+      task.f();
+    } // try
+    catch(...)
+    {
+      task.exception = std::current_exception();
+      task.is_failed = true;
+    } // catch
+    task.time_end = clock_t::now();
+  } // if
+  // Release the dependents
+  std::lock_guard lock(m_mutex);
+  for(size_t id_dependent : task.vec_dependents)
+  {
+    Task& dependent = m_tasks[id_dependent];
+    dependent.is_failed |= task.is_failed;
+    qcontinue_if(--dependent.count_deps_pending > 0);
+    ((dependent.affinity == Affinity::MAIN)? m_queue_main : m_queue_any).push_back(id_dependent);
+  } // for
+  ++m_count_done;
+  m_cv.notify_all();
+} // execute() }}}
+
+// worker() {{{
+inline void Scheduler::worker(Affinity affinity)
+{
+  std::deque<size_t>& queue = (affinity == Affinity::MAIN)? m_queue_main : m_queue_any;
+  while ( true )
+  {
+    size_t id;
+    {
+      std::unique_lock lock(m_mutex);
+      m_cv.wait(lock, [&]{ return not queue.empty() or m_count_done == m_tasks.size(); });
+      qreturn_if(queue.empty());
+      id = queue.front();
+      queue.pop_front();
+    }
+    execute(id);
+  } // while
+} // worker() }}}
+
+// log_critical_path() {{{
+// The critical path ends in the step that finished last, and follows the dependency that
+// finished last backwards
+inline void Scheduler::log_critical_path()
+{
+  auto f_end = [&](size_t id){ return m_tasks[id].time_end; };
+  auto f_duration = [&](size_t id)
+  {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(m_tasks[id].time_end - m_tasks[id].time_begin).count();
+  };
+  std::vector<size_t> vec_ids(m_tasks.size());
+  std::ranges::generate(vec_ids, [i = 0ul]() mutable { return i++; });
+  std::vector<std::string> vec_path;
+  for(auto it = std::ranges::max_element(vec_ids, {}, f_end); it != vec_ids.end();)
+  {
+    vec_path.insert(vec_path.begin(), "{} ({}ms)"_fmt(m_tasks[*it].name, f_duration(*it)));
+    auto const& vec_deps = m_tasks[*it].vec_deps;
+    auto it_dep = std::ranges::max_element(vec_deps, {}, f_end);
+    it = (it_dep == vec_deps.end())? vec_ids.end() : std::ranges::find(vec_ids, *it_dep);
+  } // for
+  std::string str_path;
+  for(auto&& step : vec_path) { str_path += (str_path.empty()? "" : " -> ") + step; }
+  ns_log::debug()("Critical path: {}", str_path);
+} // log_critical_path() }}}
+
+// run() {{{
+// Runs all steps, rethrows the exception of the first step that failed
+inline void Scheduler::run()
+{
+  qreturn_if(m_tasks.empty());
+  // Queue the steps without dependencies
+  for(size_t id = 0; id < m_tasks.size(); ++id)
+  {
+    qcontinue_if(m_tasks[id].count_deps_pending > 0);
+    ((m_tasks[id].affinity == Affinity::MAIN)? m_queue_main : m_queue_any).push_back(id);
+  } // for
+  // Start the pool and make the current thread work on the pinned steps
+  size_t count_any = std::ranges::count_if(m_tasks, [](auto&& e){ return e.affinity == Affinity::ANY; });
+  size_t count_threads = std::min<size_t>(std::max(std::thread::hardware_concurrency(), 1u), count_any);
+  {
+    std::vector<std::jthread> vec_threads;
+    for(size_t i = 0; i < count_threads; ++i)
+    {
+      vec_threads.emplace_back([this]{ worker(Affinity::ANY); });
+    } // for
+    worker(Affinity::MAIN);
+  }
+  log_critical_path();
+  // Propagate the first failure
+  for(auto&& task : m_tasks)
+  {
+    if ( task.exception ) { std::rethrow_exception(task.exception); }
+  } // for
+} // run() }}}
+
+} // namespace ns_scheduler
+
+/* vim: set expandtab fdm=marker ts=2 sw=2 tw=100 et :*/
@@ -0,0 +1,140 @@
+///
+// @author      : Ruan E. Formigoni (ruanformigoni@gmail.com)
+// @file        : share
+///
+
+#pragma once
+
+#include <csignal>
+#include <fstream>
+#include <filesystem>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "../cpp/lib/log.hpp"
+#include "../cpp/lib/fuse.hpp"
+#include "../cpp/std/exception.hpp"
+#include "../cpp/macro.hpp"
+#include "../cpp/common.hpp"
+
+// Instances of the same image share the mounts of its read-only layers, and with them the block
+// caches of the dwarfs daemons. The shared directory holds a mountpoint per layer and a reference
+// file per instance, changes to it happen under a file lock. The first instance mounts the layers,
+// later ones attach to them and the last one to detach un-mounts them.
+namespace ns_share
+{
+
+namespace
+{
+
+namespace fs = std::filesystem;
+
+// is_alive() {{{
+inline bool is_alive(pid_t pid)
+{
+  return ::kill(pid, 0) == 0 or errno == EPERM;
+} // is_alive() }}}
+
+} // namespace
+
+// class Lock {{{
+// Exclusive lock of a shared directory, released on destruction or when the process exits
+class Lock
+{
+  private:
+    int m_fd;
+
+  public:
+    Lock(fs::path const& path_dir_shared);
+    ~Lock();
+    Lock(Lock const&) = delete;
+    Lock& operator=(Lock const&) = delete;
+}; // class Lock }}}
+
+// Lock::Lock() {{{
+inline Lock::Lock(fs::path const& path_dir_shared)
+  : m_fd(open((path_dir_shared.string() + ".lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600))
+{
+  ethrow_if(m_fd < 0, "Could not open lock of '{}': {}"_fmt(path_dir_shared, strerror(errno)));
+  // Retry if interrupted by a signal
+  int ret;
+  do { ret = flock(m_fd, LOCK_EX); } while ( ret < 0 and errno == EINTR );
+  if ( ret < 0 )
+  {
+    int error = errno;
+    close(m_fd);
+    "Could not lock '{}': {}"_throw(path_dir_shared, strerror(error));
+  } // if
+} // Lock::Lock() }}}
+
+// Lock::~Lock() {{{
+inline Lock::~Lock()
+{
+  flock(m_fd, LOCK_UN);
+  close(m_fd);
+} // Lock::~Lock() }}}
+
+// key() {{{
+// Identity of the image and of the layers it mounts, a modified image gets new mounts
+[[nodiscard]] inline std::string key(std::vector<std::tuple<fs::path,uint64_t,uint64_t>> const& vec_layers
+  , std::string_view options)
+{
+  std::string str_identity{options};
+  for(auto&& [path_file_layer, offset, size] : vec_layers)
+  {
+    struct stat st{};
+    ethrow_if(stat(path_file_layer.c_str(), &st) < 0, "Could not stat '{}': {}"_fmt(path_file_layer, strerror(errno)));
+    str_identity += ";{}:{}:{}:{}:{}:{}"_fmt(st.st_dev, st.st_ino, st.st_mtim.tv_sec, st.st_mtim.tv_nsec, offset, size);
+  } // for
+  return "{:016x}"_fmt(std::hash<std::string>{}(str_identity));
+} // key() }}}
+
+// attach() {{{
+// References the layers from the instance of pid, call with the lock held
+inline void attach(fs::path const& path_dir_shared, pid_t pid)
+{
+  fs::path path_dir_refs = path_dir_shared / "refs";
+  std::error_code ec;
+  fs::create_directories(path_dir_refs, ec);
+  ethrow_if(ec, "Could not create '{}': {}"_fmt(path_dir_refs, ec.message()));
+  std::ofstream file_ref(path_dir_refs / std::to_string(pid));
+  ethrow_if(not file_ref.is_open(), "Could not reference shared layers in '{}'"_fmt(path_dir_refs));
+} // attach() }}}
+
+// release() {{{
+// Drops the reference of pid and the ones of instances that exited without releasing them,
+// returns true if no instance references the layers anymore, call with the lock held
+[[nodiscard]] inline bool release(fs::path const& path_dir_shared, pid_t pid)
+{
+  std::error_code ec;
+  fs::path path_dir_refs = path_dir_shared / "refs";
+  fs::remove(path_dir_refs / std::to_string(pid), ec);
+  bool is_referenced = false;
+  for(auto&& entry : fs::directory_iterator(path_dir_refs, ec))
+  {
+    auto expected_pid = ns_exception::to_expected([&]{ return std::stoi(entry.path().filename().string()); });
+    if ( expected_pid and is_alive(*expected_pid) )
+    {
+      is_referenced = true;
+      continue;
+    } // if
+    ns_log::debug()("Drop stale reference '{}'", entry.path());
+    fs::remove(entry.path(), ec);
+  } // for
+  return not is_referenced;
+} // release() }}}
+
+// detach() {{{
+// Releases the reference of pid, the last instance to detach un-mounts the layers
+inline void detach(fs::path const& path_dir_shared, pid_t pid, std::vector<fs::path> const& vec_path_dir_mountpoints)
+{
+  Lock lock(path_dir_shared);
+  dreturn_if(not release(path_dir_shared, pid), "Shared layers in '{}' are still in use"_fmt(path_dir_shared));
+  ns_fuse::unmount(vec_path_dir_mountpoints);
+} // detach() }}}
+
+} // namespace ns_share
+
+/* vim: set expandtab fdm=marker ts=2 sw=2 tw=100 et :*/
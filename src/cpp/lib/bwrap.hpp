@@ -18,6 +18,7 @@
 #include "db.hpp"
 #include "match.hpp"
 #include "subprocess.hpp"
+#include "trace.hpp"
 #include "env.hpp"
 #include "reserved/permissions.hpp"
 
@@ -46,6 +47,64 @@ using Permissions = ns_reserved::ns_permissions::Permissions;
 
 } // namespace ns_permissions
 
+// test_and_setup() {{{
+[[nodiscard]] inline std::expected<fs::path, std::string> test_and_setup(fs::path const& path_file_bwrap_src)
+{
+  // Test current bwrap binary
+  auto ret = ns_subprocess::Subprocess(path_file_bwrap_src)
+    .with_piped_outputs()
+    .with_args("--bind", "/", "/", "bash", "-c", "echo")
+    .spawn()
+    .wait();
+  qreturn_if (ret and *ret == 0, path_file_bwrap_src);
+  // Try to use bwrap installed by flatimage
+  fs::path path_file_bwrap_opt = "/opt/flatimage/bwrap";
+  ret = ns_subprocess::Subprocess(path_file_bwrap_opt)
+    .with_piped_outputs()
+    .with_args("--bind", "/", "/", "bash", "-c", "echo")
+    .spawn()
+    .wait();
+  qreturn_if (ret and *ret == 0, path_file_bwrap_opt);
+  // Error might be EACCES, try to integrate with apparmor
+  auto opt_path_file_pkexec = ns_subprocess::search_path("pkexec");
+  qreturn_if(not opt_path_file_pkexec.has_value(), std::unexpected("Could not find pkexec binary"));
+  auto opt_path_file_bwrap_apparmor = ns_subprocess::search_path("fim_bwrap_apparmor");
+  qreturn_if(not opt_path_file_bwrap_apparmor.has_value(), std::unexpected("Could not find bwrap_apparmor binary"));
+  auto expected_path_dir_mount = ns_exception::to_expected([]{ return ns_env::get_or_throw("FIM_DIR_MOUNT"); });
+  qreturn_if(not expected_path_dir_mount, expected_path_dir_mount.error());
+  // pkexec closes the inherited descriptors, a bwrap in memory is written to the disk first
+  fs::path path_file_bwrap_disk = path_file_bwrap_src;
+  if ( ns_payload::memfd_name(path_file_bwrap_src) )
+  {
+    auto opt_path_file_target = ns_payload::path_file_target("bwrap");
+    qreturn_if(not opt_path_file_target, std::unexpected("Could not find target directory for bwrap"));
+    path_file_bwrap_disk = *opt_path_file_target;
+    std::error_code ec;
+    fs::copy_file(path_file_bwrap_src, path_file_bwrap_disk, fs::copy_options::overwrite_existing, ec);
+    qreturn_if(ec, std::unexpected("Could not write bwrap to '{}': {}"_fmt(path_file_bwrap_disk, ec.message())));
+    fs::permissions(path_file_bwrap_disk, fs::perms::owner_all | fs::perms::group_read | fs::perms::group_exec
+      | fs::perms::others_read | fs::perms::others_exec, ec);
+  } // if
+  ret = ns_subprocess::Subprocess(*opt_path_file_pkexec)
+    .with_args(*opt_path_file_bwrap_apparmor, *expected_path_dir_mount, path_file_bwrap_disk)
+    .spawn()
+    .wait();
+  qreturn_if(not ret, std::unexpected("Could not find create profile (abnormal exit)"));
+  qreturn_if(ret and *ret != 0, std::unexpected("Could not find create profile with exit code '{}'"_fmt(*ret)));
+  return path_file_bwrap_opt;
+} // test_and_setup() }}}
+
+// probe() {{{
+// Finds a working bwrap binary, it does not depend on the container so it can run before the
+// filesystems are mounted
+[[nodiscard]] inline std::expected<fs::path, std::string> probe()
+{
+  auto opt_path_file_bwrap = ns_subprocess::search_path("bwrap");
+  qreturn_if(not opt_path_file_bwrap.has_value(), std::unexpected("Could not find bwrap"));
+  ns_log::debug()("Using bwrap builtin");
+  return test_and_setup(*opt_path_file_bwrap);
+} // probe() }}}
+
 class Bwrap
 {
   private:
@@ -69,8 +128,8 @@ class Bwrap
       , fs::path const& path_dir_work);
     // Set XDG_RUNTIME_DIR
     void set_xdg_runtime_dir();
-    // Setup
-    std::expected<fs::path, std::string> test_and_setup(fs::path const& path_file_bwrap);
+    // Result of probe(), if it ran ahead of time
+    std::optional<std::expected<fs::path, std::string>> m_opt_expected_path_file_bwrap;
 
   public:
     template<ns_concept::StringRepresentable... Args>
@@ -102,6 +161,7 @@ class Bwrap
     Bwrap& with_bind_gpu(fs::path const& path_dir_root_guest, fs::path const& path_dir_root_host);
     Bwrap& with_bind(fs::path const& src, fs::path const& dst);
     Bwrap& with_bind_ro(fs::path const& src, fs::path const& dst);
+    Bwrap& with_probe(std::expected<fs::path, std::string> const& expected_path_file_bwrap);
     [[nodiscard]] std::pair<int,int> run(ns_permissions::PermissionBits const& permissions);
 }; // class: Bwrap
 
@@ -224,39 +284,6 @@ inline void Bwrap::set_xdg_runtime_dir()
   ns_vector::push_back(m_args, "--setenv", "XDG_RUNTIME_DIR", m_path_dir_xdg_runtime);
 } // set_xdg_runtime_dir() }}}
 
-// test_and_setup() {{{
-inline std::expected<fs::path, std::string> Bwrap::test_and_setup(fs::path const& path_file_bwrap_src)
-{
-  // Test current bwrap binary
-  auto ret = ns_subprocess::Subprocess(path_file_bwrap_src)
-    .with_piped_outputs()
-    .with_args("--bind", "/", "/", "bash", "-c", "echo")
-    .spawn()
-    .wait();
-  qreturn_if (ret and *ret == 0, path_file_bwrap_src);
-  // Try to use bwrap installed by flatimage
-  fs::path path_file_bwrap_opt = "/opt/flatimage/bwrap";
-  ret = ns_subprocess::Subprocess(path_file_bwrap_opt)
-    .with_piped_outputs()
-    .with_args("--bind", "/", "/", "bash", "-c", "echo")
-    .spawn()
-    .wait();
-  qreturn_if (ret and *ret == 0, path_file_bwrap_opt);
-  // Error might be EACCES, try to integrate with apparmor
-  auto opt_path_file_pkexec = ns_subprocess::search_path("pkexec");
-  qreturn_if(not opt_path_file_pkexec.has_value(), std::unexpected("Could not find pkexec binary"));
-  auto opt_path_file_bwrap_apparmor = ns_subprocess::search_path("fim_bwrap_apparmor");
-  qreturn_if(not opt_path_file_bwrap_apparmor.has_value(), std::unexpected("Could not find bwrap_apparmor binary"));
-  auto expected_path_dir_mount = ns_exception::to_expected([]{ return ns_env::get_or_throw("FIM_DIR_MOUNT"); });
-  qreturn_if(not expected_path_dir_mount, expected_path_dir_mount.error());
-  ret = ns_subprocess::Subprocess(*opt_path_file_pkexec)
-    .with_args(*opt_path_file_bwrap_apparmor, *expected_path_dir_mount, path_file_bwrap_src)
-    .spawn()
-    .wait();
-  qreturn_if(not ret, std::unexpected("Could not find create profile (abnormal exit)"));
-  qreturn_if(ret and *ret != 0, std::unexpected("Could not find create profile with exit code '{}'"_fmt(*ret)));
-  return path_file_bwrap_opt;
-} // test_and_setup() }}}
 
 // symlink_nvidia() {{{
 inline Bwrap& Bwrap::symlink_nvidia(fs::path const& path_dir_root_guest, fs::path const& path_dir_root_host)
@@ -519,6 +546,14 @@ inline Bwrap& Bwrap::with_bind_gpu(fs::path const& path_dir_root_guest, fs::path
   return *this;
 } // with_bind_gpu() }}}
 
+// with_probe() {{{
+// Uses the result of a probe() that ran ahead of time
+inline Bwrap& Bwrap::with_probe(std::expected<fs::path, std::string> const& expected_path_file_bwrap)
+{
+  m_opt_expected_path_file_bwrap = expected_path_file_bwrap;
+  return *this;
+} // with_probe() }}}
+
 // run() {{{
 inline std::pair<int,int> Bwrap::run(ns_permissions::PermissionBits const& permissions)
 {
@@ -538,14 +573,10 @@ inline std::pair<int,int> Bwrap::run(ns_permissions::PermissionBits const& permi
   auto opt_path_file_bash = ns_subprocess::search_path("bash");
   ethrow_if(not opt_path_file_bash.has_value(), "Could not find bash");
 
-  // Use builtin bwrap or native if exists
-  auto opt_path_file_bwrap = ns_subprocess::search_path("bwrap");
-  ethrow_if(not opt_path_file_bwrap.has_value(), "Could not find bwrap");
-  fs::path path_file_bwrap = *opt_path_file_bwrap;
-  ns_log::debug()("Using bwrap builtin");
-
-  // Test bwrap and setup apparmor if it is required
-  auto expected_path_file_bwrap = test_and_setup(path_file_bwrap);
+  // Test bwrap and setup apparmor if it is required, unless it was already done
+  ns_trace::begin("bwrap test and setup");
+  auto expected_path_file_bwrap = ( m_opt_expected_path_file_bwrap )? *m_opt_expected_path_file_bwrap : probe();
+  ns_trace::end("bwrap test and setup");
   ethrow_if(not expected_path_file_bwrap, expected_path_file_bwrap.error());
 
   // Pipe to receive errors from bwrap
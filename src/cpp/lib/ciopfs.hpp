@@ -52,6 +52,7 @@ class Ciopfs
          with_args(path_dir_lower, path_dir_upper)
         .spawn()
         .wait();
+      ns_fuse::tune(path_dir_upper, "ciopfs");
     } // ciopfs
 
     ~Ciopfs()
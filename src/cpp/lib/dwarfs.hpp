@@ -9,6 +9,7 @@
 #include "log.hpp"
 #include "fuse.hpp"
 #include "subprocess.hpp"
+#include "trace.hpp"
 #include "../macro.hpp"
 
 namespace ns_dwarfs
@@ -19,6 +20,21 @@ namespace
 
 namespace fs = std::filesystem;
 
+// options() {{{
+// Mount options of the daemon, the options of the mount profile come last to override the defaults
+inline std::vector<std::string> options(uint64_t offset
+  , uint64_t size_image
+  , uint64_t size_cache
+  , std::vector<std::string> const& vec_options)
+{
+  std::vector<std::string> vec_args{"-o", "auto_unmount,offset={},imagesize={},cachesize={}m"_fmt(offset, size_image, std::max(size_cache >> 20, uint64_t{1}))};
+  for(auto&& option : vec_options)
+  {
+    ns_vector::push_back(vec_args, "-o", option);
+  } // for
+  return vec_args;
+} // options() }}}
+
 };
 
 // class Dwarfs {{{
@@ -34,7 +50,15 @@ class Dwarfs
     Dwarfs& operator=(Dwarfs const&) = delete;
     Dwarfs& operator=(Dwarfs&&) = delete;
 
-    Dwarfs(fs::path const& path_file_image, fs::path const& path_dir_mount, uint64_t offset, uint64_t size_image, pid_t pid_to_die_for)
+    // The constructor only spawns the daemon, so several layers can be mounted at once, wait for
+    // the mountpoint with ns_fuse::wait_fuse
+    Dwarfs(fs::path const& path_file_image
+      , fs::path const& path_dir_mount
+      , uint64_t offset
+      , uint64_t size_image
+      , uint64_t size_cache
+      , std::vector<std::string> const& vec_options
+      , pid_t pid_to_die_for)
       : m_path_dir_mountpoint(path_dir_mount)
     {
       // Check if image exists and is a regular file
@@ -55,12 +79,12 @@ class Dwarfs
       m_subprocess = std::make_unique<ns_subprocess::Subprocess>(*opt_file_dwarfs);
 
       // Spawn command
-      std::ignore = m_subprocess->with_piped_outputs()
-        .with_args(path_file_image, path_dir_mount, "-f", "-o", "auto_unmount,offset={},imagesize={}"_fmt(offset, size_image))
+      // Logs go to a file next to the mountpoint, the daemon lives as long as the program
+      std::ignore = m_subprocess->with_log_file(path_dir_mount.string() + ".log")
+        .with_args(path_file_image, path_dir_mount, "-f")
+        .with_args(options(offset, size_image, size_cache, vec_options))
         .with_die_on_pid(pid_to_die_for)
         .spawn();
-      // Wait for mount
-      ns_fuse::wait_fuse(path_dir_mount);
     } // Dwarfs
     
     ~Dwarfs()
@@ -82,8 +106,39 @@ class Dwarfs
     {
       return m_path_dir_mountpoint;
     }
+
+    std::optional<pid_t> get_pid()
+    {
+      return m_subprocess->get_pid();
+    }
 }; // class Dwarfs }}}
 
+// spawn_detached() {{{
+// Spawns a daemon that outlives the boot process, it detaches after the filesystem is mounted, so
+// the returned process exits with the status of the mount. The daemon exits once un-mounted.
+[[nodiscard]] inline std::unique_ptr<ns_subprocess::Subprocess> spawn_detached(fs::path const& path_file_image
+  , fs::path const& path_dir_mount
+  , uint64_t offset
+  , uint64_t size_image
+  , uint64_t size_cache
+  , std::vector<std::string> const& vec_options)
+{
+  ethrow_if(not fs::is_regular_file(path_file_image)
+    , "'{}' does not exist or is not a regular file"_fmt(path_file_image)
+  );
+  ethrow_if(not fs::is_directory(path_dir_mount)
+    , "'{}' does not exist or is not a directory"_fmt(path_dir_mount)
+  );
+  auto opt_file_dwarfs = ns_subprocess::search_path("dwarfs");
+  ethrow_if(not opt_file_dwarfs.has_value(), "Could not find dwarfs");
+  auto subprocess = std::make_unique<ns_subprocess::Subprocess>(*opt_file_dwarfs);
+  std::ignore = subprocess->with_log_file(path_dir_mount.string() + ".log")
+    .with_args(path_file_image, path_dir_mount)
+    .with_args(options(offset, size_image, size_cache, vec_options))
+    .spawn();
+  return subprocess;
+} // spawn_detached() }}}
+
 // is_dwarfs() {{{
 inline bool is_dwarfs(fs::path const& path_file_dwarfs, uint64_t offset = 0)
 {
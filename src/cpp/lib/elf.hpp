@@ -9,6 +9,7 @@
 #include <cstdint>
 #include <fstream>
 #include <elf.h>
+#include <fcntl.h>
 #include <cstdlib>
 #include <cstring>
 #include <unistd.h>
@@ -16,6 +17,7 @@
 #include <sys/types.h>
 
 #include "log.hpp"
+#include "linux.hpp"
 
 #include "../macro.hpp"
 #include "../common.hpp"
@@ -33,33 +35,27 @@ namespace fs = std::filesystem;
 
 // copy_binary() {{{
 // Copies the binary data between [offset.first, offset.second] from path_file_input to path_file_output
-inline void copy_binary(fs::path const& path_file_input, fs::path const& path_file_output, std::pair<uint64_t,uint64_t> offset)
+[[nodiscard]] inline std::error<std::string> copy_binary(fs::path const& path_file_input
+  , fs::path const& path_file_output
+  , std::pair<uint64_t,uint64_t> offset)
 {
-  std::ifstream f_in{path_file_input, std::ios::binary};
-  std::ofstream f_out{path_file_output, std::ios::binary};
+  int fd_in = open(path_file_input.c_str(), O_RDONLY | O_CLOEXEC);
+  qreturn_if(fd_in < 0, "Failed to open in file {}: {}"_fmt(path_file_input, strerror(errno)));
 
-  ereturn_if(not f_in.good() , "Failed to open in file {}\n"_fmt(path_file_input));
-  ereturn_if(not f_out.good(), "Failed to open out file {}\n"_fmt(path_file_output));
-
-  // Calculate the size of the data to read
-  uint64_t size = offset.second - offset.first;
-
-  // Seek to the start offset in the input file
-  f_in.seekg(offset.first, std::ios::beg);
-
-  // Read in chunks
-  const size_t size_buf = 4096;
-  char buffer[size_buf];
-
-  while( size > 0 )
+  int fd_out = open(path_file_output.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0770);
+  if ( fd_out < 0 )
   {
-    std::streamsize read_size = static_cast<std::streamsize>(std::min(static_cast<uint64_t>(size_buf), size));
+    close(fd_in);
+    return "Failed to open out file {}: {}"_fmt(path_file_output, strerror(errno));
+  } // if
+
+  // Move the data range in kernel space
+  auto error = ns_linux::copy_range(fd_in, fd_out, offset.first, offset.second - offset.first);
 
-    f_in.read(buffer, read_size);
-    f_out.write(buffer, read_size);
+  close(fd_in);
+  close(fd_out);
 
-    size -= read_size;
-  } // while
+  return error;
 } // function: copy_binary
 
 // }}}
@@ -5,14 +5,25 @@
 
 #pragma once
 
+#include <cerrno>
 #include <cstring>
 #include <filesystem>
 #include <expected>
 #include <sys/vfs.h>
 #include <sys/mount.h>
 #include <thread>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <cctype>
+#include <fstream>
 
 #include "subprocess.hpp"
+#include "env.hpp"
+#include "../std/exception.hpp"
 
 // Other codes available here:
 // https://man7.org/linux/man-pages/man2/statfs.2.html
@@ -26,6 +37,26 @@ namespace
 
 namespace fs = std::filesystem;
 
+// pidfd_open() {{{
+// Descriptor that becomes readable when the process exits, -1 if the kernel does not support it
+inline int pidfd_open(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+  return static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+#else
+  return -1;
+#endif
+} // pidfd_open() }}}
+
+// is_exited() {{{
+// Checks if a process exited, children are not reaped so their owner can still collect the status
+inline bool is_exited(pid_t pid)
+{
+  siginfo_t info{};
+  qreturn_if(waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT) < 0, ::kill(pid, 0) < 0);
+  return info.si_pid == pid;
+} // is_exited() }}}
+
 } // namespace 
 
 // Check if a directory is mounted with fuse
@@ -41,53 +72,234 @@ inline std::expected<bool,std::string> is_fuse(fs::path const& path_dir_mount)
   return buf.f_type == FUSE_SUPER_MAGIC;
 } // function: mountpoint
 
-inline void wait_fuse(fs::path const& path_dir_filesystem)
+// Check if a directory is still a fuse mountpoint, the mount of a daemon that died fails statfs
+// with ENOTCONN and still has to be detached
+inline bool is_mounted(fs::path const& path_dir_mount)
 {
-  using namespace std::chrono_literals;
-  auto time_beg = std::chrono::system_clock::now();
+  struct statfs buf;
+  qreturn_if(statfs(path_dir_mount.c_str(), &buf) < 0, errno == ENOTCONN);
+  return buf.f_type == FUSE_SUPER_MAGIC;
+} // function: is_mounted
+
+// Waits for a group of filesystems to be mounted, returns the ones that failed to mount. Instead
+// of spinning on statfs, it sleeps in poll until the mount table changes or a daemon exits.
+inline std::vector<fs::path> wait_fuse(std::vector<std::pair<fs::path,std::optional<pid_t>>> const& vec_mount
+  , std::chrono::milliseconds timeout = std::chrono::seconds(60))
+{
+  struct Pending
+  {
+    fs::path path_dir_filesystem;
+    std::optional<pid_t> opt_pid_daemon;
+    int fd_pid;
+  };
+  std::vector<fs::path> vec_path_dir_failed;
+  // The mount table is opened before the first check, so mounts that happen after it wake up poll
+  int fd_mountinfo = open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
+  elog_if(fd_mountinfo < 0, "Could not open mountinfo: {}"_fmt(strerror(errno)));
+  std::vector<Pending> vec_pending = vec_mount
+    | std::views::transform([](auto&& e)
+      {
+        return Pending{e.first, e.second, e.second.transform(pidfd_open).value_or(-1)};
+      })
+    | std::ranges::to<std::vector<Pending>>();
+  auto time_end = std::chrono::steady_clock::now() + timeout;
   while ( true )
   {
-    auto expected_is_fuse = ns_fuse::is_fuse(path_dir_filesystem);
-    ebreak_if(not expected_is_fuse, "Could not check if filesystem is fuse");
-    dbreak_if( *expected_is_fuse, "Filesystem '{}' is fuse"_fmt(path_dir_filesystem));
-    auto time_cur = std::chrono::system_clock::now();
-    auto elapsed = std::chrono::duration_cast<std::chrono::seconds>(time_cur - time_beg);
-    ebreak_if(elapsed.count() > 60, "Reached timeout to wait for fuse filesystems");
+    // Remove the mounted filesystems and the ones that failed
+    std::erase_if(vec_pending, [&](Pending const& pending)
+    {
+      auto f_fail = [&](std::string const& msg)
+      {
+        ns_log::error()(msg);
+        vec_path_dir_failed.push_back(pending.path_dir_filesystem);
+        if ( pending.fd_pid >= 0 ) { close(pending.fd_pid); }
+        return true;
+      };
+      auto expected_is_fuse = ns_fuse::is_fuse(pending.path_dir_filesystem);
+      qreturn_if(not expected_is_fuse, f_fail("Could not check if filesystem '{}' is fuse: {}"_fmt(
+        pending.path_dir_filesystem, expected_is_fuse.error()
+      )));
+      if ( *expected_is_fuse )
+      {
+        ns_log::debug()("Filesystem '{}' is fuse", pending.path_dir_filesystem);
+        if ( pending.fd_pid >= 0 ) { close(pending.fd_pid); }
+        return true;
+      } // if
+      qreturn_if(not pending.opt_pid_daemon or not is_exited(*pending.opt_pid_daemon), false);
+      // A detached daemon exits once mounted, the mount could complete after the check above
+      if ( ns_fuse::is_fuse(pending.path_dir_filesystem).value_or(false) )
+      {
+        ns_log::debug()("Filesystem '{}' is fuse", pending.path_dir_filesystem);
+        if ( pending.fd_pid >= 0 ) { close(pending.fd_pid); }
+        return true;
+      } // if
+      return f_fail("Daemon '{}' of filesystem '{}' exited before mounting"_fmt(*pending.opt_pid_daemon, pending.path_dir_filesystem));
+    });
+    qbreak_if(vec_pending.empty());
+    // Check for timeout
+    auto ms_remaining = std::chrono::duration_cast<std::chrono::milliseconds>(time_end - std::chrono::steady_clock::now()).count();
+    if ( ms_remaining <= 0 )
+    {
+      ns_log::error()("Reached timeout to wait for fuse filesystems");
+      for(auto&& pending : vec_pending)
+      {
+        vec_path_dir_failed.push_back(pending.path_dir_filesystem);
+        if ( pending.fd_pid >= 0 ) { close(pending.fd_pid); }
+      } // for
+      break;
+    } // if
+    // Wait for a change in the mount table or the exit of a daemon
+    std::vector<pollfd> vec_pollfd;
+    if ( fd_mountinfo >= 0 ) { vec_pollfd.push_back(pollfd{ .fd = fd_mountinfo, .events = POLLPRI, .revents = 0 }); }
+    for(auto&& pending : vec_pending)
+    {
+      if ( pending.fd_pid >= 0 ) { vec_pollfd.push_back(pollfd{ .fd = pending.fd_pid, .events = POLLIN, .revents = 0 }); }
+    } // for
+    // Without a descriptor for some event, fall back to checking it in short intervals
+    bool is_blind = fd_mountinfo < 0 or std::ranges::any_of(vec_pending, [](auto&& e){ return e.opt_pid_daemon and e.fd_pid < 0; });
+    poll(vec_pollfd.data(), vec_pollfd.size(), static_cast<int>(is_blind? std::min<int64_t>(ms_remaining, 100) : ms_remaining));
   } // while
+  if ( fd_mountinfo >= 0 ) { close(fd_mountinfo); }
+  return vec_path_dir_failed;
+} // function: wait_fuse
+
+inline void wait_fuse(fs::path const& path_dir_filesystem, std::optional<pid_t> opt_pid_daemon = std::nullopt)
+{
+  std::ignore = wait_fuse(std::vector<std::pair<fs::path,std::optional<pid_t>>>{{path_dir_filesystem, opt_pid_daemon}});
 } // function: wait_fuse
 
 
-inline void unmount(fs::path const& path_dir_mountpoint)
+// Limits of the kernel side of a fuse connection, the kernel defaults of 12 and 9 throttle the
+// parallel reads issued by readahead
+struct Tuning
+{
+  uint32_t max_background;
+  uint32_t congestion_threshold;
+};
+
+// Tuning of a backend, overridden by FIM_FUSE_TUNING_<BACKEND>=<max_background>:<congestion_threshold>
+// and disabled with FIM_FUSE_TUNING=0
+inline std::optional<Tuning> tuning(std::string_view backend)
+{
+  qreturn_if(ns_env::exists("FIM_FUSE_TUNING", "0"), std::nullopt);
+  std::string name_backend = std::string{backend}
+    | std::views::transform([](char c){ return static_cast<char>(std::toupper(c)); })
+    | std::ranges::to<std::string>();
+  if ( auto opt_tuning = ns_env::get_optional<std::string>("FIM_FUSE_TUNING_" + name_backend) )
+  {
+    auto vec_values = ns_vector::from_string(*opt_tuning, ':');
+    auto expected_tuning = ns_exception::to_expected([&]
+    {
+      return Tuning{ uint32_t(std::stoul(vec_values.at(0))), uint32_t(std::stoul(vec_values.at(1))) };
+    });
+    if ( expected_tuning ) { return *expected_tuning; }
+    ns_log::error()("Invalid FIM_FUSE_TUNING_{} '{}'", name_backend, *opt_tuning);
+  } // if
+  // Read-only compressed layers benefit the most from parallel reads
+  return ( backend == "dwarfs" or backend == "overlayfs" )? Tuning{64, 48} : Tuning{32, 24};
+} // function: tuning
+
+// Directory of the connection of a fuse mount in the fusectl filesystem
+inline std::expected<fs::path,std::string> connection(fs::path const& path_dir_mount)
+{
+  struct stat st;
+  qreturn_if(stat(path_dir_mount.c_str(), &st) < 0, std::unexpected(strerror(errno)));
+  // The connection is named after the device number in the kernel encoding
+  uint64_t id = (uint64_t{major(st.st_dev)} << 20) | minor(st.st_dev);
+  fs::path path_dir_connection = fs::path{"/sys/fs/fuse/connections"} / std::to_string(id);
+  qreturn_if(not fs::is_directory(path_dir_connection)
+    , std::unexpected("Connection '{}' does not exist"_fmt(path_dir_connection))
+  );
+  return path_dir_connection;
+} // function: connection
+
+// Applies the tuning of the backend to the connection of the mount, it requires write access to
+// fusectl, which usually is only granted to root
+inline void tune(fs::path const& path_dir_mount, std::string_view backend)
+{
+  auto opt_tuning = tuning(backend);
+  qreturn_if(not opt_tuning);
+  auto expected_path_dir_connection = connection(path_dir_mount);
+  dreturn_if(not expected_path_dir_connection
+    , "Could not find fuse connection of '{}': {}"_fmt(path_dir_mount, expected_path_dir_connection.error())
+  );
+  auto f_write = [&](std::string_view name, uint32_t value)
+  {
+    std::ofstream file(*expected_path_dir_connection / name);
+    return file.is_open() and (file << value) and (file.flush(), file.good());
+  };
+  dreturn_if(not f_write("max_background", opt_tuning->max_background)
+    or not f_write("congestion_threshold", opt_tuning->congestion_threshold)
+    , "Not permitted to tune fuse connection of '{}'"_fmt(path_dir_mount)
+  );
+  ns_log::debug()("Tuned fuse connection of '{}' to max_background={} congestion_threshold={}"
+    , path_dir_mount
+    , opt_tuning->max_background
+    , opt_tuning->congestion_threshold
+  );
+} // function: tune
+
+// Detaches a group of independent mountpoints in parallel. The umount2 syscall is tried first, it
+// succeeds with privileges, the remaining ones go through fusermount, which is allowed to
+// un-mount the fuse filesystems of the user.
+inline void unmount(std::vector<fs::path> const& vec_path_dir_mountpoint)
 {
   using namespace std::chrono_literals;
+  auto time_beg = std::chrono::steady_clock::now();
 
-  // Find fusermount
-  auto opt_path_file_fusermount = ns_subprocess::search_path("fusermount");
-  ereturn_if (not opt_path_file_fusermount, "Could not find 'fusermount' in PATH");
+  // Skip mountpoints that are not mounted, e.g., janitor after a clean exit
+  std::vector<fs::path> vec_path_dir_pending = vec_path_dir_mountpoint
+    | std::views::filter([](auto&& e){ return ns_fuse::is_mounted(e); })
+    | std::ranges::to<std::vector<fs::path>>();
+  qreturn_if(vec_path_dir_pending.empty());
 
-  // Un-mount filesystem
-  auto ret = ns_subprocess::Subprocess(*opt_path_file_fusermount)
-    .with_piped_outputs()
-    .with_args("-zu", path_dir_mountpoint)
-    .spawn()
-    .wait();
+  // Detach with the syscall
+  std::erase_if(vec_path_dir_pending, [](fs::path const& path_dir_mountpoint)
+  {
+    qreturn_if(umount2(path_dir_mountpoint.c_str(), MNT_DETACH) < 0, false);
+    ns_log::debug()("Un-mounted filesystem '{}'", path_dir_mountpoint);
+    return true;
+  });
 
-  // Check for successful un-mount
-  if(ret and *ret == 0)
+  // Detach with fusermount, spawn all before waiting
+  if ( not vec_path_dir_pending.empty() )
   {
-    ns_log::debug()("Un-mounted filesystem '{}'"_fmt(path_dir_mountpoint));
+    static std::optional<std::string> const opt_path_file_fusermount = ns_subprocess::search_path("fusermount");
+    ereturn_if (not opt_path_file_fusermount, "Could not find 'fusermount' in PATH");
+    std::vector<std::unique_ptr<ns_subprocess::Subprocess>> vec_subprocess;
+    for(fs::path const& path_dir_mountpoint : vec_path_dir_pending)
+    {
+      vec_subprocess.push_back(std::make_unique<ns_subprocess::Subprocess>(*opt_path_file_fusermount));
+      std::ignore = vec_subprocess.back()->with_args("-zu", path_dir_mountpoint).spawn();
+    } // for
+    for(size_t i = 0; i < vec_subprocess.size(); ++i)
+    {
+      auto ret = vec_subprocess[i]->wait();
+      econtinue_if(not ret or *ret != 0, "Could not un-mount filesystem '{}'"_fmt(vec_path_dir_pending[i]));
+      ns_log::debug()("Un-mounted filesystem '{}'", vec_path_dir_pending[i]);
+    } // for
   } // if
 
   // Filesystem could be busy for a bit after un-mount
-  std::expected<bool,std::string> expected_is_fuse = ns_fuse::is_fuse(*opt_path_file_fusermount);
-  while( expected_is_fuse and *expected_is_fuse )
+  auto time_end = std::chrono::steady_clock::now() + 5s;
+  for(fs::path const& path_dir_mountpoint : vec_path_dir_mountpoint)
   {
-    std::this_thread::sleep_for(100ms);
-    expected_is_fuse = ns_fuse::is_fuse(*opt_path_file_fusermount);
-  } // while
+    while ( ns_fuse::is_mounted(path_dir_mountpoint) and std::chrono::steady_clock::now() < time_end )
+    {
+      std::this_thread::sleep_for(10ms);
+    } // while
+    elog_if(ns_fuse::is_mounted(path_dir_mountpoint), "Filesystem '{}' is still mounted"_fmt(path_dir_mountpoint));
+  } // for
 
-  // Check for query errors
-  ereturn_if(not expected_is_fuse, expected_is_fuse.error());
+  ns_log::debug()("Un-mounted {} filesystems in {}ms"
+    , vec_path_dir_mountpoint.size()
+    , std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - time_beg).count()
+  );
+} // function: unmount
+
+inline void unmount(fs::path const& path_dir_mountpoint)
+{
+  unmount(std::vector<fs::path>{path_dir_mountpoint});
 } // function: unmount
 
 } // namespace ns_fuse
@@ -7,8 +7,10 @@
 
 #include <cstring>
 #include <string>
+#include <vector>
 #include <filesystem>
 #include <unistd.h>
+#include <sys/sendfile.h>
 
 #include "log.hpp"
 #include "../common.hpp"
@@ -51,6 +53,51 @@ namespace fs = std::filesystem;
 }
 // mkstemp() }}}
 
+// copy_range() {{{
+// Copies 'size' bytes starting at 'offset_in' of fd_in to the current position of fd_out
+// Bytes are moved in kernel space with copy_file_range, with a fallback to sendfile and then to
+// chunked pread/write for filesystems that support neither. The file position of fd_in is not
+// changed, so the same input descriptor can be shared between threads.
+[[nodiscard]] inline std::error<std::string> copy_range(int fd_in, int fd_out, uint64_t offset_in, uint64_t size)
+{
+  off_t off_in = offset_in;
+
+  // Try to copy with copy_file_range, stops on EXDEV, ENOSYS, EINVAL, ...
+  while ( size > 0 )
+  {
+    ssize_t bytes = ::copy_file_range(fd_in, &off_in, fd_out, nullptr, size, 0);
+    qbreak_if(bytes <= 0);
+    size -= bytes;
+  } // while
+
+  // Try to copy the remaining bytes with sendfile
+  while ( size > 0 )
+  {
+    ssize_t bytes = ::sendfile(fd_out, fd_in, &off_in, size);
+    qbreak_if(bytes <= 0);
+    size -= bytes;
+  } // while
+
+  // Fallback to a buffered copy in user space
+  std::vector<char> buffer(std::min(size, uint64_t{1} << 20));
+  while ( size > 0 )
+  {
+    ssize_t bytes_read = ::pread(fd_in, buffer.data(), std::min(size, uint64_t{buffer.size()}), off_in);
+    qreturn_if(bytes_read < 0, "Failed to read from input file: {}"_fmt(strerror(errno)));
+    qreturn_if(bytes_read == 0, "Unexpected end of input file at offset '{}'"_fmt(off_in));
+    for(ssize_t bytes_written = 0; bytes_written < bytes_read;)
+    {
+      ssize_t bytes = ::write(fd_out, buffer.data() + bytes_written, bytes_read - bytes_written);
+      qreturn_if(bytes < 0, "Failed to write to output file: {}"_fmt(strerror(errno)));
+      bytes_written += bytes;
+    } // for
+    off_in += bytes_read;
+    size -= bytes_read;
+  } // while
+
+  return std::nullopt;
+} // function: copy_range() }}}
+
 // module_check() {{{
 inline std::expected<bool, std::string> module_check(std::string_view str_name)
 {
@@ -5,8 +5,10 @@
 
 #pragma once
 
+#include <mutex>
 #include <filesystem>
 #include <fstream>
+#include <pthread.h>
 
 #include "../common.hpp"
 #include "../std/concept.hpp"
@@ -35,6 +37,8 @@ class Logger
   private:
     std::optional<std::ofstream> m_opt_os;
     Level m_level;
+    // Serializes the writes of threads that log at once
+    std::mutex m_mutex;
   public:
     Logger();
     Logger(Logger const&) = delete;
@@ -45,6 +49,7 @@ class Logger
     Level get_level() const;
     void set_sink_file(fs::path path_file_sink);
     std::optional<std::ofstream>& get_sink_file();
+    std::mutex& get_mutex();
 }; // class Logger }}}
 
 // fn: Logger::Logger {{{
@@ -63,6 +68,7 @@ inline void Logger::set_sink_file(fs::path path_file_sink)
   } // if
 
   // File output stream
+  std::lock_guard lock(m_mutex);
   m_opt_os = std::ofstream{path_file_sink};
 
   if( m_opt_os->bad() ) { std::runtime_error("Could not open file '{}'"_fmt(path_file_sink)); };
@@ -74,6 +80,12 @@ inline std::optional<std::ofstream>& Logger::get_sink_file()
   return m_opt_os;
 } // fn: Logger::get_sink_file }}}
 
+// fn: Logger::get_mutex {{{
+inline std::mutex& Logger::get_mutex()
+{
+  return m_mutex;
+} // fn: Logger::get_mutex }}}
+
 // fn: Logger::set_level {{{
 inline void Logger::set_level(Level level)
 {
@@ -88,6 +100,13 @@ inline Level Logger::get_level() const
 
 static Logger logger;
 
+// A fork while another thread logs would leave the lock held in the child, so it is taken around
+// fork and released on both sides
+static int const fork_handlers = pthread_atfork([]{ logger.get_mutex().lock(); }
+  , []{ logger.get_mutex().unlock(); }
+  , []{ logger.get_mutex().unlock(); }
+);
+
 } // namespace
 
 // fn: set_level {{{
@@ -142,6 +161,7 @@ class info
     requires ( ( ns_concept::StringRepresentable<Args> or ns_concept::IterableConst<Args> ) and ... )
     void operator()(T&& format, Args&&... args)
     {
+      std::lock_guard lock(logger.get_mutex());
       auto& opt_ostream_sink = logger.get_sink_file();
       print_if(opt_ostream_sink, *opt_ostream_sink, "I::{}::{}\n"_fmt(m_loc.get(), format), args...);
       print_if((logger.get_level() >= Level::INFO), std::cout, "I::{}::{}\n"_fmt(m_loc.get(), format), std::forward<Args>(args)...);
@@ -160,6 +180,7 @@ class error
     requires ( ( ns_concept::StringRepresentable<Args> or ns_concept::IterableConst<Args> ) and ... )
     void operator()(T&& format, Args&&... args)
     {
+      std::lock_guard lock(logger.get_mutex());
       auto& opt_ostream_sink = logger.get_sink_file();
       print_if(opt_ostream_sink, *opt_ostream_sink, "E::{}::{}\n"_fmt(m_loc.get(), format), args...);
       print_if((logger.get_level() >= Level::ERROR), std::cerr, "E::{}::{}\n"_fmt(m_loc.get(), format), std::forward<Args>(args)...);
@@ -178,6 +199,7 @@ class debug
     requires ( ( ns_concept::StringRepresentable<Args> or ns_concept::IterableConst<Args> ) and ... )
     void operator()(T&& format, Args&&... args)
     {
+      std::lock_guard lock(logger.get_mutex());
       auto& opt_ostream_sink = logger.get_sink_file();
       print_if(opt_ostream_sink, *opt_ostream_sink, "D::{}::{}\n"_fmt(m_loc.get(), format), args...);
       print_if((logger.get_level() >= Level::DEBUG), std::cerr, "D::{}::{}\n"_fmt(m_loc.get(), format), std::forward<Args>(args)...);
@@ -0,0 +1,493 @@
+///
+// @author      : Ruan E. Formigoni (ruanformigoni@gmail.com)
+// @file        : payload
+///
+
+#pragma once
+
+#include <array>
+#include <memory>
+#include <vector>
+#include <span>
+#include <mutex>
+#include <ranges>
+#include <charconv>
+#include <algorithm>
+#include <cstring>
+#include <expected>
+#include <filesystem>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <zstd.h>
+
+#include "log.hpp"
+#include "elf.hpp"
+#include "linux.hpp"
+#include "../macro.hpp"
+#include "../common.hpp"
+
+// The payload are the helper binaries appended after the boot program. They are indexed by a
+// table of contents written right after the boot program, which is read with a single pread.
+// [boot][toc][helper_0][helper_1]...[helper_n][reserved][layers...]
+namespace ns_payload
+{
+
+namespace
+{
+
+namespace fs = std::filesystem;
+
+} // namespace
+
+constexpr std::array<char,8> const TOC_MAGIC{'F','I','M','T','O','C','0','2'};
+constexpr size_t const TOC_MAX_ENTRIES = 32;
+
+enum class Codec : uint64_t
+{
+  NONE = 0,
+  ZSTD = 1,
+};
+
+#pragma pack(push, 1)
+// struct Entry {{{
+struct Entry
+{
+  // Null terminated name of the helper
+  char name[32];
+  // Sha256sum of the decompressed helper in hex format
+  char hash[64];
+  // Absolute offset of the helper in the binary
+  uint64_t offset;
+  // Size in bytes of the helper in the binary
+  uint64_t size;
+  // Size in bytes of the helper once decompressed
+  uint64_t size_decompressed;
+  // Compression of the helper in the binary
+  Codec codec;
+
+  std::string_view get_name() const { return std::string_view(name, strnlen(name, sizeof(name))); }
+  std::string_view get_hash() const { return std::string_view(hash, strnlen(hash, sizeof(hash))); }
+}; // struct Entry }}}
+
+// struct Toc {{{
+struct Toc
+{
+  std::array<char,8> magic;
+  // Number of valid entries
+  uint64_t count;
+  // First byte after the last helper
+  uint64_t offset_end;
+  std::array<Entry,TOC_MAX_ENTRIES> entries;
+
+  std::span<Entry const> get_entries() const { return std::span(entries.data(), count); }
+}; // struct Toc }}}
+#pragma pack(pop)
+
+// read() {{{
+// Reads the table of contents located after the boot program
+[[nodiscard]] inline std::expected<Toc,std::string> read(fs::path const& path_file_binary)
+{
+  uint64_t offset = ns_elf::skip_elf_header(path_file_binary);
+  int fd = open(path_file_binary.c_str(), O_RDONLY | O_CLOEXEC);
+  qreturn_if(fd < 0, std::unexpected("Could not open '{}': {}"_fmt(path_file_binary, strerror(errno))));
+  Toc toc;
+  ssize_t bytes = pread(fd, &toc, sizeof(toc), offset);
+  close(fd);
+  qreturn_if(bytes != sizeof(toc), std::unexpected("Short read for table of contents in '{}'"_fmt(path_file_binary)));
+  qreturn_if(toc.magic != TOC_MAGIC, std::unexpected("Invalid table of contents in '{}'"_fmt(path_file_binary)));
+  qreturn_if(toc.count > TOC_MAX_ENTRIES, std::unexpected("Invalid number of entries '{}'"_fmt(toc.count)));
+  return toc;
+} // read() }}}
+
+// find() {{{
+[[nodiscard]] inline std::optional<Entry> find(Toc const& toc, std::string_view name)
+{
+  auto entries = toc.get_entries();
+  auto it = std::ranges::find_if(entries, [&](auto&& e){ return e.get_name() == name; });
+  return (it != entries.end())? std::make_optional(*it) : std::nullopt;
+} // find() }}}
+
+// path_file_target() {{{
+// Location where the helper is extracted to, busybox has its own directory with the applet symlinks
+[[nodiscard]] inline std::optional<fs::path> path_file_target(std::string_view name)
+{
+  const char* str_dir = std::getenv((name == "busybox")? "FIM_DIR_BUSYBOX" : "FIM_DIR_APP_BIN");
+  qreturn_if(str_dir == nullptr, std::nullopt);
+  return fs::path{str_dir} / name;
+} // path_file_target() }}}
+
+// path_dir_store() {{{
+// Content-addressed store shared by all flatimage versions, helpers are keyed by their sha256sum
+[[nodiscard]] inline fs::path path_dir_store()
+{
+  const char* str_dir_global = std::getenv("FIM_DIR_GLOBAL");
+  return fs::path{(str_dir_global)? str_dir_global : "/tmp/fim"} / "store";
+} // path_dir_store() }}}
+
+// decompress() {{{
+// Decompresses the zstd stream in the range [offset, offset+size) of fd_in to the current position of
+// fd_out
+[[nodiscard]] inline std::error<std::string> decompress(int fd_in, int fd_out, uint64_t offset, uint64_t size)
+{
+  std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)> ctx(ZSTD_createDCtx(), ZSTD_freeDCtx);
+  qreturn_if(not ctx, "Could not create decompression context");
+  std::vector<char> buffer_in(ZSTD_DStreamInSize());
+  std::vector<char> buffer_out(ZSTD_DStreamOutSize());
+  size_t ret = 0;
+  for(uint64_t pos = 0; pos < size;)
+  {
+    ssize_t bytes_read = pread(fd_in, buffer_in.data(), std::min(size - pos, uint64_t{buffer_in.size()}), offset + pos);
+    qreturn_if(bytes_read < 0, "Failed to read from input file: {}"_fmt(strerror(errno)));
+    qreturn_if(bytes_read == 0, "Unexpected end of input file at offset '{}'"_fmt(offset + pos));
+    pos += bytes_read;
+    ZSTD_inBuffer input{buffer_in.data(), size_t(bytes_read), 0};
+    // Drain the output until the input is consumed and the decoder has nothing left to flush
+    for(bool is_flushed = false; input.pos < input.size or not is_flushed;)
+    {
+      ZSTD_outBuffer output{buffer_out.data(), buffer_out.size(), 0};
+      ret = ZSTD_decompressStream(ctx.get(), &output, &input);
+      qreturn_if(ZSTD_isError(ret), "Failed to decompress: {}"_fmt(ZSTD_getErrorName(ret)));
+      for(size_t bytes_written = 0; bytes_written < output.pos;)
+      {
+        ssize_t bytes = ::write(fd_out, buffer_out.data() + bytes_written, output.pos - bytes_written);
+        qreturn_if(bytes < 0, "Failed to write to output file: {}"_fmt(strerror(errno)));
+        bytes_written += bytes;
+      } // for
+      is_flushed = output.pos < output.size;
+    } // for
+  } // for
+  qreturn_if(ret != 0, "Compressed stream is truncated");
+  return std::nullopt;
+} // decompress() }}}
+
+// copy() {{{
+// Writes the decompressed helper to the current position of fd_out
+[[nodiscard]] inline std::error<std::string> copy(int fd_binary, Entry const& entry, int fd_out)
+{
+  switch(entry.codec)
+  {
+    case Codec::NONE: return ns_linux::copy_range(fd_binary, fd_out, entry.offset, entry.size);
+    case Codec::ZSTD: return decompress(fd_binary, fd_out, entry.offset, entry.size);
+  } // switch
+  return "Unknown codec '{}' for '{}'"_fmt(uint64_t(entry.codec), entry.get_name());
+} // copy() }}}
+
+// publish() {{{
+// Writes the helper to path_file_store atomically, the file is only visible once complete
+[[nodiscard]] inline std::error<std::string> publish(int fd_binary, Entry const& entry, fs::path const& path_file_store)
+{
+  // Try an anonymous file that is linked into the store once written
+  if ( int fd_file = open(path_file_store.parent_path().c_str(), O_TMPFILE | O_WRONLY | O_CLOEXEC, 0755); fd_file >= 0 )
+  {
+    fchmod(fd_file, 0755);
+    auto error = copy(fd_binary, entry, fd_file);
+    if ( not error and linkat(AT_FDCWD, "/proc/self/fd/{}"_fmt(fd_file).c_str()
+      , AT_FDCWD, path_file_store.c_str(), AT_SYMLINK_FOLLOW) < 0 )
+    {
+      error = "Could not link '{}': {}"_fmt(path_file_store, strerror(errno));
+    } // if
+    close(fd_file);
+    return error;
+  } // if
+  // Fallback to write-then-rename, O_TMPFILE is not supported by every filesystem
+  std::string str_file_tmp = path_file_store.string() + ".XXXXXX";
+  int fd_file = mkstemp(str_file_tmp.data());
+  qreturn_if(fd_file < 0, "Could not create temporary file '{}': {}"_fmt(str_file_tmp, strerror(errno)));
+  fchmod(fd_file, 0755);
+  auto error = copy(fd_binary, entry, fd_file);
+  close(fd_file);
+  if ( not error and rename(str_file_tmp.c_str(), path_file_store.c_str()) < 0 )
+  {
+    error = "Could not rename '{}' to '{}': {}"_fmt(str_file_tmp, path_file_store, strerror(errno));
+  } // if
+  if ( error ) { unlink(str_file_tmp.c_str()); }
+  return error;
+} // publish() }}}
+
+// is_published() {{{
+// A published helper is a regular file of the decompressed size, only writable by its owner, which is
+// this user or root
+[[nodiscard]] inline bool is_published(Entry const& entry, fs::path const& path_file)
+{
+  struct stat st;
+  qreturn_if(stat(path_file.c_str(), &st) < 0, false);
+  uint64_t size = (entry.codec == Codec::NONE)? entry.size : entry.size_decompressed;
+  return S_ISREG(st.st_mode)
+    and uint64_t(st.st_size) == size
+    and (st.st_mode & (S_IWGRP | S_IWOTH)) == 0
+    and (st.st_uid == getuid() or st.st_uid == 0);
+} // is_published() }}}
+
+// publish_once() {{{
+// Publishes the helper to path_file_dst if it does not exist, concurrent launches extract it once
+[[nodiscard]] inline std::error<std::string> publish_once(int fd_binary, Entry const& entry, fs::path const& path_file_dst)
+{
+  // Files are complete once visible
+  qreturn_if(is_published(entry, path_file_dst), std::nullopt);
+  // Serialize the extraction of this helper across processes
+  fs::path path_file_lock = path_file_dst.string() + ".lock";
+  int fd_lock = -1;
+  while ( true )
+  {
+    fd_lock = open(path_file_lock.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    qreturn_if(fd_lock < 0, "Could not open lock '{}': {}"_fmt(path_file_lock, strerror(errno)));
+    if ( flock(fd_lock, LOCK_EX) < 0 )
+    {
+      close(fd_lock);
+      return "Could not lock '{}': {}"_fmt(path_file_lock, strerror(errno));
+    } // if
+    // The lock is removed by the process that published the helper, waiters on it try again
+    struct stat st_fd, st_path;
+    qbreak_if(fstat(fd_lock, &st_fd) == 0 and stat(path_file_lock.c_str(), &st_path) == 0
+      and st_fd.st_dev == st_path.st_dev and st_fd.st_ino == st_path.st_ino
+    );
+    close(fd_lock);
+    qreturn_if(is_published(entry, path_file_dst), std::nullopt);
+  } // while
+  // Another process could have published the helper while this one waited for the lock, an entry
+  // that does not match the helper is replaced
+  std::error<std::string> error;
+  if ( not is_published(entry, path_file_dst) )
+  {
+    std::error_code ec;
+    fs::remove(path_file_dst, ec);
+    error = publish(fd_binary, entry, path_file_dst);
+  } // if
+  // Remove the lock before closing the descriptor releases it
+  unlink(path_file_lock.c_str());
+  close(fd_lock);
+  return error;
+} // publish_once() }}}
+
+// store() {{{
+// Makes the helper available in the store
+[[nodiscard]] inline std::expected<fs::path,std::string> store(int fd_binary, Entry const& entry)
+{
+  qreturn_if(entry.get_hash().empty(), std::unexpected("Missing hash for '{}'"_fmt(entry.get_name())));
+  fs::path path_dir = path_dir_store();
+  std::error_code ec;
+  fs::create_directories(path_dir, ec);
+  qreturn_if(ec, std::unexpected("Could not create directory '{}': {}"_fmt(path_dir, ec.message())));
+  fs::path path_file_store = path_dir / entry.get_hash();
+  auto error = publish_once(fd_binary, entry, path_file_store);
+  qreturn_if(error, std::unexpected(*error));
+  return path_file_store;
+} // store() }}}
+
+// extract() {{{
+// Links the helper from the store to path_file_dst if it does not exist
+[[nodiscard]] inline std::error<std::string> extract(int fd_binary, Entry const& entry, fs::path const& path_file_dst)
+{
+  // Follows the symlink, a helper removed from the store or that does not match it is extracted again
+  qreturn_if(is_published(entry, path_file_dst), std::nullopt);
+  auto expected_path_file_store = store(fd_binary, entry);
+  qreturn_if(not expected_path_file_store, expected_path_file_store.error());
+  // Replace the link atomically, concurrent launches and the threads of this one could be creating
+  // it as well
+  fs::path path_file_tmp = "{}.{}.{}"_fmt(path_file_dst, getpid(), gettid());
+  std::error_code ec;
+  fs::remove(path_file_tmp, ec);
+  fs::create_symlink(*expected_path_file_store, path_file_tmp, ec);
+  qreturn_if(ec, "Could not create symlink '{}': {}"_fmt(path_file_tmp, ec.message()));
+  fs::rename(path_file_tmp, path_file_dst, ec);
+  qreturn_if(ec, "Could not rename '{}' to '{}': {}"_fmt(path_file_tmp, path_file_dst, ec.message()));
+  return std::nullopt;
+} // extract() }}}
+
+// is_memfd() {{{
+// Helpers are executed from sealed memory files instead of being written to the disk
+[[nodiscard]] inline bool is_memfd()
+{
+  const char* str_memfd = std::getenv("FIM_MEMFD");
+  return str_memfd != nullptr and std::string_view{str_memfd} == "1";
+} // is_memfd() }}}
+
+// is_guest() {{{
+// Helpers that run inside the container must be available in the filesystem, as well as the ones
+// executed through pkexec, which closes the inherited descriptors
+[[nodiscard]] inline bool is_guest(std::string_view name)
+{
+  return name == "bash" or name == "busybox" or name == "fim_portal" or name == "fim_bwrap_apparmor";
+} // is_guest() }}}
+
+// struct MemfdRegistry {{{
+// Helpers in memory of this process, 'name=fd:name=fd...' in the environment
+struct MemfdRegistry
+{
+  std::mutex mutex;
+  std::vector<std::pair<std::string,int>> entries;
+}; // struct MemfdRegistry }}}
+
+// memfd_state() {{{
+// The registry is read once from the environment. Helpers loaded on first use register from
+// several threads, so it is only written back to the environment by memfd_export.
+inline MemfdRegistry& memfd_state()
+{
+  static MemfdRegistry registry{ .mutex = {}, .entries = []
+  {
+    std::vector<std::pair<std::string,int>> entries;
+    const char* str_registry = std::getenv("FIM_MEMFD_REGISTRY");
+    qreturn_if(str_registry == nullptr, entries);
+    for(auto&& entry : std::string_view{str_registry} | std::views::split(':'))
+    {
+      std::string_view view_entry(entry.begin(), entry.end());
+      auto pos = view_entry.find('=');
+      qcontinue_if(pos == std::string_view::npos);
+      int fd = -1;
+      std::from_chars(view_entry.data() + pos + 1, view_entry.data() + view_entry.size(), fd);
+      // Skip descriptors that were not inherited
+      qcontinue_if(fd < 0 or fcntl(fd, F_GETFD) < 0);
+      // Executing /proc/self/fd/N works with close-on-exec, which keeps it from children
+      fcntl(fd, F_SETFD, FD_CLOEXEC);
+      entries.emplace_back(view_entry.substr(0, pos), fd);
+    } // for
+    return entries;
+  }()};
+  return registry;
+} // memfd_state() }}}
+
+// memfd_registry() {{{
+// The registry maps helper names to file descriptors
+[[nodiscard]] inline std::vector<std::pair<std::string,int>> memfd_registry()
+{
+  auto& registry = memfd_state();
+  std::lock_guard lock(registry.mutex);
+  return registry.entries;
+} // memfd_registry() }}}
+
+// memfd_register() {{{
+// Makes the descriptor available to this process as 'name'
+inline void memfd_register(std::string_view name, int fd)
+{
+  auto& registry = memfd_state();
+  std::lock_guard lock(registry.mutex);
+  registry.entries.emplace_back(name, fd);
+} // memfd_register() }}}
+
+// memfd_export() {{{
+// Passes the registry to the program executed next, call it when no other thread is running
+inline void memfd_export()
+{
+  for(auto&& [name, fd] : memfd_registry()) { fcntl(fd, F_SETFD, 0); }
+  std::string str_registry = ns_string::from_container(memfd_registry()
+    | std::views::transform([](auto&& e){ return "{}={}"_fmt(e.first, e.second); })
+    , ':'
+  );
+  setenv("FIM_MEMFD_REGISTRY", str_registry.c_str(), 1);
+} // memfd_export() }}}
+
+// memfd_import() {{{
+// Takes the registry inherited from the launcher, so it does not leak into the container and the
+// daemons. Call it when no other thread is running.
+inline void memfd_import()
+{
+  std::ignore = memfd_state();
+  unsetenv("FIM_MEMFD_REGISTRY");
+} // memfd_import() }}}
+
+// memfd_path() {{{
+// Path that executes the registered helper
+[[nodiscard]] inline std::optional<fs::path> memfd_path(std::string_view name)
+{
+  auto registry = memfd_registry();
+  auto it = std::ranges::find_if(registry, [&](auto&& e){ return e.first == name; });
+  qreturn_if(it == registry.end(), std::nullopt);
+  return fs::path{"/proc/self/fd"} / std::to_string(it->second);
+} // memfd_path() }}}
+
+// memfd_name() {{{
+// Name of the helper registered for path, used as argv0 since the universal dwarfs binary
+// dispatches on it
+[[nodiscard]] inline std::optional<std::string> memfd_name(fs::path const& path_file)
+{
+  qreturn_if(path_file.parent_path() != "/proc/self/fd", std::nullopt);
+  auto registry = memfd_registry();
+  auto it = std::ranges::find_if(registry, [&](auto&& e){ return std::to_string(e.second) == path_file.filename(); });
+  qreturn_if(it == registry.end(), std::nullopt);
+  return it->first;
+} // memfd_name() }}}
+
+// memfd() {{{
+// Copies the helper into a sealed memory file, memfd_export passes the descriptor to the boot program
+[[nodiscard]] inline std::expected<int,std::string> memfd(int fd_binary, Entry const& entry)
+{
+  int fd = memfd_create(std::string{entry.get_name()}.c_str(), MFD_ALLOW_SEALING | MFD_CLOEXEC);
+  qreturn_if(fd < 0, std::unexpected("Could not create memfd for '{}': {}"_fmt(entry.get_name(), strerror(errno))));
+  if ( auto error = copy(fd_binary, entry, fd); error )
+  {
+    close(fd);
+    return std::unexpected(*error);
+  } // if
+  // The content can no longer be modified
+  elog_if(fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0
+    , "Could not seal memfd for '{}': {}"_fmt(entry.get_name(), strerror(errno))
+  );
+  return fd;
+} // memfd() }}}
+
+// memfd_alias() {{{
+// Registers name with a duplicate of the descriptor of name_target, aliases need a distinct
+// descriptor number to be told apart by memfd_name
+[[nodiscard]] inline std::optional<fs::path> memfd_alias(std::string_view name, std::string_view name_target)
+{
+  auto registry = memfd_registry();
+  auto it = std::ranges::find_if(registry, [&](auto&& e){ return e.first == name_target; });
+  qreturn_if(it == registry.end(), std::nullopt);
+  int fd = dup(it->second);
+  ereturn_if(fd < 0, "Could not duplicate descriptor of '{}': {}"_fmt(name_target, strerror(errno)), std::nullopt);
+  memfd_register(name, fd);
+  return fs::path{"/proc/self/fd"} / std::to_string(fd);
+} // memfd_alias() }}}
+
+// extract_lazy() {{{
+// Extracts a helper that was not extracted on boot, used on first use by ns_subprocess::search_path
+[[nodiscard]] inline std::optional<fs::path> extract_lazy(std::string_view name)
+{
+  // Only available inside a flatimage
+  const char* str_file_binary = std::getenv("FIM_FILE_BINARY");
+  qreturn_if(str_file_binary == nullptr, std::nullopt);
+  // The dwarfs tools are symlinks to the universal binary
+  std::string_view name_helper = (name == "dwarfs" or name == "mkdwarfs")? "dwarfs_aio" : name;
+  // Find helper in the table of contents
+  auto toc = read(str_file_binary);
+  qreturn_if(not toc, std::nullopt);
+  auto entry = find(*toc, name_helper);
+  qreturn_if(not entry, std::nullopt);
+  auto path_file_helper = path_file_target(name_helper);
+  ereturn_if(not path_file_helper, "Could not find target directory for '{}'"_fmt(name_helper), std::nullopt);
+  // The universal binary could already be in memory
+  if ( is_memfd() and name_helper != name )
+  {
+    if ( auto opt_path_file_alias = memfd_alias(name, name_helper) ) { return opt_path_file_alias; }
+  } // if
+  int fd_binary = open(str_file_binary, O_RDONLY | O_CLOEXEC);
+  ereturn_if(fd_binary < 0, "Could not open '{}': {}"_fmt(str_file_binary, strerror(errno)), std::nullopt);
+  // Load in memory
+  if ( is_memfd() and not is_guest(name_helper) )
+  {
+    auto expected_fd = memfd(fd_binary, *entry);
+    close(fd_binary);
+    ereturn_if(not expected_fd, expected_fd.error(), std::nullopt);
+    memfd_register(name_helper, *expected_fd);
+    ns_log::debug()("PAYLOAD: Loaded '{}' in memory on first use", name_helper);
+    return (name_helper == name)? memfd_path(name) : memfd_alias(name, name_helper);
+  } // if
+  // Extract
+  auto error = extract(fd_binary, *entry, *path_file_helper);
+  close(fd_binary);
+  ereturn_if(error, *error, std::nullopt);
+  ns_log::debug()("PAYLOAD: Extracted '{}' on first use", name_helper);
+  qreturn_if(name_helper == name, path_file_helper);
+  // Create the symlink to the universal binary
+  fs::path path_file_link = path_file_helper->parent_path() / name;
+  std::error_code ec;
+  fs::create_symlink(*path_file_helper, path_file_link, ec);
+  return path_file_link;
+} // extract_lazy() }}}
+
+} // namespace ns_payload
+
+/* vim: set expandtab fdm=marker ts=2 sw=2 tw=100 et :*/
@@ -0,0 +1,50 @@
+///
+// @author      : Ruan E. Formigoni (ruanformigoni@gmail.com)
+// @file        : dwarfs
+///
+
+#pragma once
+
+#include <string>
+#include <cstring>
+#include <filesystem>
+#include "../reserved.hpp"
+#include "../../macro.hpp"
+
+// Mount profiles of the dwarfs layers, stored as json in the reserved space
+namespace ns_reserved::ns_dwarfs
+{
+
+namespace
+{
+
+namespace fs = std::filesystem;
+
+}
+
+// write() {{{
+inline std::error<std::string> write(fs::path const& path_file_binary
+  , uint64_t offset
+  , uint64_t size
+  , std::string_view raw_json
+)
+{
+  qreturn_if(raw_json.size() >= size, "Not enough space to fit json data");
+  return ns_reserved::write(path_file_binary, offset, size, raw_json.data(), raw_json.size());
+} // write() }}}
+
+// read() {{{
+// Returns an empty string if no profile was written
+inline std::expected<std::string,std::string> read(fs::path const& path_file_binary
+  , uint64_t offset
+  , uint64_t size)
+{
+  auto buffer = std::make_unique<char[]>(size);
+  auto expected_read = ns_reserved::read(path_file_binary, offset, size, buffer.get());
+  qreturn_if(not expected_read, std::unexpected(expected_read.error()));
+  return std::string(buffer.get(), strnlen(buffer.get(), size));
+} // read() }}}
+
+} // namespace ns_reserved::ns_dwarfs
+
+/* vim: set expandtab fdm=marker ts=2 sw=2 tw=100 et :*/
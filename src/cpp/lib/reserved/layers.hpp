@@ -0,0 +1,88 @@
+///
+// @author      : Ruan E. Formigoni (ruanformigoni@gmail.com)
+// @file        : layers
+///
+
+#pragma once
+
+#include <array>
+#include <vector>
+#include <cstring>
+#include <filesystem>
+#include "../reserved.hpp"
+#include "../../macro.hpp"
+
+// Table of the layers appended to the image, it describes the whole stack so it is read at once
+// instead of seeking through the size prefix of every layer
+namespace ns_reserved::ns_layers
+{
+
+namespace
+{
+
+namespace fs = std::filesystem;
+
+constexpr std::array<char,8> const MAGIC{'F','I','M','L','A','Y','R','1'};
+
+struct Header
+{
+  std::array<char,8> magic;
+  uint64_t count;
+};
+
+} // namespace
+
+// struct Layer {{{
+struct Layer
+{
+  // Start of the filesystem, past its size prefix
+  uint64_t offset;
+  uint64_t size;
+  // Filesystem type, e.g., 'dwarfs'
+  std::array<char,8> format;
+  // Hash of the filesystem contents, 0 if unknown
+  uint64_t hash;
+  // Seconds since the epoch, 0 if unknown
+  uint64_t time_created;
+  // Hash of the layer below, 0 for the bottom layer
+  uint64_t hash_parent;
+}; // struct Layer }}}
+
+static_assert(sizeof(Header) == 16 and sizeof(Layer) == 48);
+
+// write() {{{
+inline std::error<std::string> write(fs::path const& path_file_binary
+  , uint64_t offset
+  , uint64_t size
+  , std::vector<Layer> const& vec_layers)
+{
+  uint64_t length = sizeof(Header) + vec_layers.size() * sizeof(Layer);
+  qreturn_if(length > size, "Not enough space to fit {} layers in the layer table"_fmt(vec_layers.size()));
+  std::vector<char> buffer(length);
+  Header header{ .magic = MAGIC, .count = vec_layers.size() };
+  std::memcpy(buffer.data(), &header, sizeof(header));
+  std::memcpy(buffer.data() + sizeof(header), vec_layers.data(), vec_layers.size() * sizeof(Layer));
+  return ns_reserved::write(path_file_binary, offset, size, buffer.data(), buffer.size());
+} // write() }}}
+
+// read() {{{
+// Reads the table with a single read, fails if the image has no table
+inline std::expected<std::vector<Layer>,std::string> read(fs::path const& path_file_binary
+  , uint64_t offset
+  , uint64_t size)
+{
+  std::vector<char> buffer(size);
+  auto expected_read = ns_reserved::read(path_file_binary, offset, size, buffer.data());
+  qreturn_if(not expected_read, std::unexpected(expected_read.error()));
+  Header header;
+  std::memcpy(&header, buffer.data(), sizeof(header));
+  qreturn_if(header.magic != MAGIC, std::unexpected("Image has no layer table"));
+  qreturn_if(header.count > (size - sizeof(Header)) / sizeof(Layer), std::unexpected("Corrupted layer table"));
+  std::vector<Layer> vec_layers(header.count);
+  std::memcpy(vec_layers.data(), buffer.data() + sizeof(header), header.count * sizeof(Layer));
+  return vec_layers;
+} // read() }}}
+
+} // namespace ns_reserved::ns_layers
+
+/* vim: set expandtab fdm=marker ts=2 sw=2 tw=100 et :*/
@@ -55,12 +55,13 @@ class SquashFs
       m_subprocess = std::make_unique<ns_subprocess::Subprocess>(*opt_path_file_squashfs);
 
       // Spawn command
-       std::ignore = m_subprocess->with_piped_outputs()
+       std::ignore = m_subprocess->with_log_file(path_dir_mount.string() + ".log")
         .with_args("-f", "-o", "offset={}"_fmt(offset))
         .with_args(path_file_image, path_dir_mount)
         .spawn();
       // Wait for mount
-      ns_fuse::wait_fuse(path_dir_mount);
+      ns_fuse::wait_fuse(path_dir_mount, m_subprocess->get_pid());
+      ns_fuse::tune(path_dir_mount, "squashfs");
     } // SquashFs
     
     ~SquashFs()
@@ -7,6 +7,7 @@
 
 #include <cstring>
 #include <functional>
+#include <fcntl.h>
 #include <sys/wait.h>
 #include <csignal>
 #include <vector>
@@ -17,6 +18,8 @@
 #include <ranges>
 
 #include "log.hpp"
+#include "payload.hpp"
+#include "trace.hpp"
 #include "../macro.hpp"
 #include "../std/vector.hpp"
 
@@ -33,6 +36,20 @@ namespace fs = std::filesystem;
 // search_path() {{{
 inline std::optional<std::string> search_path(std::string const& s)
 {
+  // Helpers loaded in memory take precedence over the ones in PATH
+  if ( auto opt_path_file_memfd = ns_payload::memfd_path(s) )
+  {
+    ns_log::debug()("PATH: Found '{}' in memory as '{}'", s, *opt_path_file_memfd);
+    return opt_path_file_memfd->string();
+  } // if
+
+  // Helpers embedded in the flatimage take precedence over the host, they are extracted on first use
+  if ( auto opt_path_file_helper = ns_payload::extract_lazy(s) )
+  {
+    ns_log::debug()("PATH: Found '{}' in the image as '{}'", s, *opt_path_file_helper);
+    return opt_path_file_helper->string();
+  } // if
+
   const char* cstr_path = getenv("PATH");
   ereturn_if(cstr_path == nullptr, "PATH: Could not read PATH", std::nullopt);
 
@@ -67,10 +84,13 @@ class Subprocess
     std::optional<std::function<void(std::string)>> m_fstdout;
     std::optional<std::function<void(std::string)>> m_fstderr;
     bool m_with_piped_outputs;
+    std::optional<fs::path> m_opt_path_file_log;
+    std::optional<int> m_opt_fd_stdout;
     std::optional<pid_t> m_die_on_pid;
 
     [[nodiscard]] Subprocess& with_pipes_parent(int pipestdout[2], int pipestderr[2]);
     void with_pipes_child(int pipestdout[2], int pipestderr[2]);
+    void with_log_file_child(fs::path const& path_file_log);
     void die_on_pid(pid_t pid);
   public:
     template<ns_concept::StringRepresentable T>
@@ -114,6 +134,10 @@ class Subprocess
 
     [[nodiscard]] Subprocess& with_piped_outputs();
 
+    [[nodiscard]] Subprocess& with_log_file(fs::path const& path_file_log);
+
+    [[nodiscard]] Subprocess& with_stdout_fd(int fd);
+
     template<typename F>
     [[nodiscard]] Subprocess& with_stdout_handle(F&& f);
 
@@ -131,8 +155,8 @@ Subprocess::Subprocess(T&& t)
   : m_program(ns_string::to_string(t))
   , m_with_piped_outputs(false)
 {
-  // argv0 is program name
-  m_args.push_back(m_program);
+  // argv0 is program name, helpers in memory are named by the registry
+  m_args.push_back(ns_payload::memfd_name(m_program).value_or(m_program));
   // Copy environment
   for(char** i = environ; *i != nullptr; ++i)
   {
@@ -292,6 +316,23 @@ inline Subprocess& Subprocess::with_piped_outputs()
   return *this;
 } // with_piped_outputs() }}}
 
+// with_log_file() {{{
+// Redirects stdout and stderr to a file, unlike piped outputs it does not fork reader processes,
+// which suits long running daemons
+inline Subprocess& Subprocess::with_log_file(fs::path const& path_file_log)
+{
+  m_opt_path_file_log = path_file_log;
+  return *this;
+} // with_log_file() }}}
+
+// with_stdout_fd() {{{
+// Redirects stdout to an open file descriptor, the child writes at its current offset
+inline Subprocess& Subprocess::with_stdout_fd(int fd)
+{
+  m_opt_fd_stdout = fd;
+  return *this;
+} // with_stdout_fd() }}}
+
 // with_pipes_parent() {{{
 inline Subprocess& Subprocess::with_pipes_parent(int pipestdout[2], int pipestderr[2])
 {
@@ -357,6 +398,16 @@ inline void Subprocess::with_pipes_child(int pipestdout[2], int pipestderr[2])
   ereturn_if(close(pipestderr[1]) == -1, "pipestderr[1]: {}"_fmt(strerror(errno)));
 } // with_pipes_child() }}}
 
+// with_log_file_child() {{{
+inline void Subprocess::with_log_file_child(fs::path const& path_file_log)
+{
+  int fd_log = open(path_file_log.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+  ereturn_if(fd_log < 0, "Could not open log file '{}': {}"_fmt(path_file_log, strerror(errno)));
+  ereturn_if(dup2(fd_log, STDOUT_FILENO) == -1, "dup2(fd_log, stdout): {}"_fmt(strerror(errno)));
+  ereturn_if(dup2(fd_log, STDERR_FILENO) == -1, "dup2(fd_log, stderr): {}"_fmt(strerror(errno)));
+  close(fd_log);
+} // with_log_file_child() }}}
+
 // die_on_pid() {{{
 inline void Subprocess::die_on_pid(pid_t pid)
 {
@@ -396,7 +447,10 @@ inline std::optional<int> Subprocess::wait()
 
   // Wait for current process
   int status;
-  waitpid(*m_opt_pid, &status, 0);
+  if ( waitpid(*m_opt_pid, &status, 0) > 0 )
+  {
+    ns_trace::async_end(fs::path(m_args.front()).filename().string(), *m_opt_pid);
+  } // if
 
   // Send SIGTERM for reader forks
   std::ranges::for_each(m_vec_pids_pipe, [](pid_t pid){ ::kill(pid, SIGTERM); });
@@ -417,8 +471,11 @@ inline Subprocess& Subprocess::spawn()
   int pipestderr[2];
 
   // Create pipe
-  ereturn_if(pipe(pipestdout), strerror(errno), *this);
-  ereturn_if(pipe(pipestderr), strerror(errno), *this);
+  if ( m_with_piped_outputs )
+  {
+    ereturn_if(pipe(pipestdout), strerror(errno), *this);
+    ereturn_if(pipe(pipestderr), strerror(errno), *this);
+  } // if
 
   // Ignore on empty vec_argv
   if ( m_args.empty() )
@@ -437,6 +494,7 @@ inline Subprocess& Subprocess::spawn()
   // On parent, return exit code of child
   if ( *m_opt_pid > 0 )
   {
+    ns_trace::async_begin(fs::path(m_args.front()).filename().string(), *m_opt_pid);
     if ( m_with_piped_outputs )
     {
       return with_pipes_parent(pipestdout, pipestderr);
@@ -452,7 +510,18 @@ inline Subprocess& Subprocess::spawn()
   {
     // this is non-blocking, setup pipes and perform execve afterwards
     with_pipes_child(pipestdout, pipestderr);
-  } // else
+  } // if
+  else if ( m_opt_path_file_log )
+  {
+    with_log_file_child(*m_opt_path_file_log);
+  } // else if
+
+  // Replace stdout, after the log file so the output is not mixed with the logs
+  if ( m_opt_fd_stdout and dup2(*m_opt_fd_stdout, STDOUT_FILENO) == -1 )
+  {
+    ns_log::error()("dup2(fd, stdout): {}", strerror(errno));
+    std::abort();
+  } // if
 
   // Check if should die with pid
   if ( m_die_on_pid )
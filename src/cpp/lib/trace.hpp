@@ -0,0 +1,146 @@
+///
+// @author      : Ruan E. Formigoni (ruanformigoni@gmail.com)
+// @file        : trace
+///
+
+#pragma once
+
+#include <string>
+#include <tuple>
+#include <string_view>
+#include <ctime>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "../common.hpp"
+
+// Timeline of the boot phases in the trace event format, enabled with FIM_TRACE=/path/to/file.json
+// Events are appended with O_APPEND by every process of the launch, timestamps come from the
+// monotonic clock so they are comparable across execve and fork. The array is left open, which
+// is accepted by trace viewers.
+namespace ns_trace
+{
+
+namespace
+{
+
+// fd() {{{
+// Descriptor of the trace file, -1 if tracing is disabled, forked children share it
+inline int fd()
+{
+  static int fd = []
+  {
+    const char* str_file_trace = std::getenv("FIM_TRACE");
+    if ( str_file_trace == nullptr or *str_file_trace == '\0' ) { return -1; }
+    int fd = open(str_file_trace, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    // The first process starts the array
+    struct stat st;
+    if ( fd >= 0 and fstat(fd, &st) == 0 and st.st_size == 0 ) { std::ignore = ::write(fd, "[\n", 2); }
+    return fd;
+  }();
+  return fd;
+} // fd() }}}
+
+// timestamp() {{{
+// Microseconds from the monotonic clock
+inline uint64_t timestamp()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return uint64_t(ts.tv_sec) * 1'000'000 + ts.tv_nsec / 1'000;
+} // timestamp() }}}
+
+// escape() {{{
+inline std::string escape(std::string_view str)
+{
+  std::string result;
+  for(char c : str)
+  {
+    if ( c == '"' or c == '\\' ) { result += '\\'; }
+    if ( static_cast<unsigned char>(c) < 0x20 ) { continue; }
+    result += c;
+  } // for
+  return result;
+} // escape() }}}
+
+// emit() {{{
+// Writes one event with a single write, so events from concurrent processes do not interleave
+inline void emit(std::string_view name, char phase, std::string_view extra = "")
+{
+  int fd_trace = fd();
+  if ( fd_trace < 0 ) { return; }
+  std::string event = R"({{"name":"{}","cat":"fim","ph":"{}","ts":{},"pid":{},"tid":{}{}}},)"_fmt(
+      escape(name), phase, timestamp(), getpid(), syscall(SYS_gettid), extra
+  ) + "\n";
+  std::ignore = ::write(fd_trace, event.data(), event.size());
+} // emit() }}}
+
+} // namespace
+
+// is_enabled() {{{
+inline bool is_enabled()
+{
+  return fd() >= 0;
+} // is_enabled() }}}
+
+// begin() {{{
+// Starts a span on the current thread
+inline void begin(std::string_view name)
+{
+  emit(name, 'B');
+} // begin() }}}
+
+// end() {{{
+// Ends the last span started on the current thread
+inline void end(std::string_view name)
+{
+  emit(name, 'E');
+} // end() }}}
+
+// instant() {{{
+inline void instant(std::string_view name)
+{
+  emit(name, 'i', R"(,"s":"p")");
+} // instant() }}}
+
+// async_begin() {{{
+// Starts a span that can end in another thread or process, identified by id
+inline void async_begin(std::string_view name, uint64_t id)
+{
+  emit(name, 'b', R"(,"id":{})"_fmt(id));
+} // async_begin() }}}
+
+// async_end() {{{
+inline void async_end(std::string_view name, uint64_t id)
+{
+  emit(name, 'e', R"(,"id":{})"_fmt(id));
+} // async_end() }}}
+
+// class Span {{{
+// Span of the enclosing scope, execve does not run destructors so it must end before
+class Span
+{
+  private:
+    std::string m_name;
+  public:
+    Span(std::string_view name)
+      : m_name(name)
+    {
+      begin(m_name);
+    } // Span
+
+    Span(Span const&) = delete;
+    Span& operator=(Span const&) = delete;
+
+    ~Span()
+    {
+      end(m_name);
+    } // ~Span
+}; // class Span }}}
+
+} // namespace ns_trace
+
+/* vim: set expandtab fdm=marker ts=2 sw=2 tw=100 et :*/
@@ -68,7 +68,8 @@ class UnionFs
         .with_die_on_pid(pid_to_die_for)
         .spawn();
       // Wait for mount
-      ns_fuse::wait_fuse(path_dir_mountpoint);
+      ns_fuse::wait_fuse(path_dir_mountpoint, m_subprocess->get_pid());
+      ns_fuse::tune(path_dir_mountpoint, "unionfs");
     } // unionfs
 
     ~UnionFs()